@@ -2,6 +2,8 @@
 filename="result.csv"
 dir=`dirname "$0"`
 export OMP_PLACES=cores
+# on a multi-socket machine pass "--pin_threads --numa_interleave=2" as the second
+# argument to spread the threads and the top of the index over the NUMA nodes
 
 run() {
     echo "testcase: $1"
@@ -5,73 +5,122 @@
 #include <unistd.h>
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <memory>
 #include <random>
 #include <string>
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <thread>
+#include <type_traits>
 
 #include "tscns.h"
 #include "omp.h"
 #include "tbb/parallel_sort.h"
 #include "flags.h"
 #include "utils.h"
+#include "histogram.h"
+#include "perf_events.h"
+#include "numa.h"
+#include "index_adapters.h"
 
-#include "../core/lipp.h"
-
-template<typename KEY_TYPE, typename PAYLOAD_TYPE>
+// INDEX is one of the adapters of index_adapters.h
+template<typename INDEX>
 class Benchmark {
-    LIPP<KEY_TYPE, PAYLOAD_TYPE> index;
+    typedef typename INDEX::key_type KEY_TYPE;
+    typedef typename INDEX::payload_type PAYLOAD_TYPE;
+    INDEX index;
 
-    enum Operation {
-        READ = 0, INSERT, DELETE, SCAN, UPDATE
+    enum Operation : uint8_t {
+        READ = 0, INSERT, DELETE, SCAN, UPDATE, READ_MODIFY_WRITE, NUM_OPERATIONS
     };
 
+    // operations are generated in blocks, each from its own stream seeded by
+    // (seed, block), so the result does not depend on the number of threads
+    static constexpr size_t OPERATION_BLOCK = 1 << 16;
+
     // parameters
     double read_ratio = 1;
     double insert_ratio = 0;
+    double scan_ratio = 0;
+    double delete_ratio = 0;
+    double update_ratio = 0;
+    double rmw_ratio = 0;
+    int scan_length = 100;
     size_t operations_num;
     long long int table_size = -1;
     size_t init_table_size;
     double init_table_ratio;
     size_t thread_num = 1;
+    size_t batch_size = 1;
     std::string keys_file_path;
     std::string keys_file_type;
     std::string sample_distribution;
+    double zipf_theta;
     bool latency_sample = false;
     double latency_sample_ratio = 0.01;
     std::string output_path;
+    int monitor_interval = 0;
+    bool perf_counters = false;
+    bool pin_threads = false;
+    std::string timeline_path;
+    std::string snapshot_path;
     size_t random_seed;
 
     std::vector <KEY_TYPE> init_keys;
     KEY_TYPE *keys;
-    std::pair <KEY_TYPE, PAYLOAD_TYPE> *init_key_values;
-    std::vector <std::pair<Operation, KEY_TYPE>> operations;
+    // the i-th operation is op_types[i] on op_keys[i], 9 bytes per operation
+    std::unique_ptr<Operation[]> op_types;
+    std::unique_ptr<KEY_TYPE[]> op_keys;
     std::mt19937 gen;
+    // spreads the benchmark threads and the TBB workers over the NUMA nodes with --pin_threads
+    std::unique_ptr<ThreadPinning> pinning;
+
+    static constexpr const char *OPERATION_NAMES[NUM_OPERATIONS] = {"read", "insert", "delete", "scan", "update", "rmw"};
 
     struct Stat {
-        std::vector<double> latency;
+        // sampled latencies in TSC ticks, by operation and over all operations
+        LatencyHistogram latency[NUM_OPERATIONS];
+        LatencyHistogram all_latency;
+        double ns_per_tick = 1;
         uint64_t throughput = 0;
         long long memory_consumption = 0;
+        // hardware events summed over the threads, -1 if a thread could not count one
+        long long perf[PerfEvents::NUM_EVENTS];
     } stat;
 
     struct alignas(CACHELINE_SIZE)
     ThreadParam {
-        std::vector<std::pair<uint64_t, uint64_t>> latency;
+        alignas(CACHELINE_SIZE) std::atomic<uint64_t> ops{0}; // operations done, read by the monitor
+        alignas(CACHELINE_SIZE) LatencyHistogram latency[NUM_OPERATIONS]; // in TSC ticks
+        long long perf[PerfEvents::NUM_EVENTS];
     };
     typedef ThreadParam param_t;
 
 public:
-    Benchmark() {}
+    explicit Benchmark(const IndexOptions &options) : index(options) {}
 
     void load_keys() {
+        // from here on TBB workers are pinned as they start, so the bulk load touches
+        // the memory of the index from every NUMA node. They are placed after the
+        // thread_num benchmark threads so the two never share a CPU
+        if (pin_threads) {
+            pinning.reset(new ThreadPinning(thread_num));
+            pinning->observe(true);
+            printf("Pinning threads round robin over %d NUMA nodes, %d cpus\n", pinning->num_nodes(), pinning->num_cpus());
+        }
+
         // Read keys from file
         // COUT_THIS("Loading keys from file.");
-
-        if (table_size > 0) keys = new KEY_TYPE[table_size];
-
+        auto phase_start = std::chrono::steady_clock::now();
+        auto phase_seconds = [&phase_start]() {
+            auto now = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(now - phase_start).count();
+            phase_start = now;
+            return seconds;
+        };
 
         if (keys_file_type == "binary") {
             table_size = load_binary_data(keys, table_size, keys_file_path);
@@ -89,8 +138,11 @@ public:
             COUT_THIS("Could not open key file, please check the path of key file.");
             exit(0);
         }
+        double read_seconds = phase_seconds();
+
         tbb::parallel_sort(keys, keys + table_size);
         std::shuffle(keys, keys + table_size, gen);
+        double shuffle_seconds = phase_seconds();
 
         init_table_size = init_table_ratio * table_size;
 
@@ -100,130 +152,309 @@ public:
             init_keys[i] = (keys[i]);
         }
         tbb::parallel_sort(init_keys.begin(), init_keys.end());
-
-        init_key_values = new std::pair<KEY_TYPE, PAYLOAD_TYPE>[init_keys.size()];
-#pragma omp parallel for num_threads(thread_num)
-        for (long unsigned int i = 0; i < init_keys.size(); i++) {
-            init_key_values[i].first = init_keys[i];
-            init_key_values[i].second = init_keys[i];
+        double init_seconds = phase_seconds();
+
+        // an existing snapshot replaces the bulk load if it holds the same initial keys,
+        // i.e. was saved from the same key file and init_table_ratio; otherwise the bulk
+        // loaded index is saved over it
+        bool opened = false;
+        if constexpr (INDEX::HAS_SNAPSHOT) {
+            if (!snapshot_path.empty()) {
+                opened = index.open(snapshot_path, init_keys.data(), init_keys.size());
+                if (!opened && access(snapshot_path.c_str(), F_OK) == 0) {
+                    printf("Snapshot %s is not one of these initial keys, replacing it\n", snapshot_path.c_str());
+                }
+            }
+        }
+        if (!opened) {
+            // COUT_THIS("Bulk loading.");
+            // payloads equal the keys, so the key array doubles as the value array
+            if constexpr (std::is_same<KEY_TYPE, PAYLOAD_TYPE>::value) {
+                index.bulk_load(init_keys.data(), init_keys.data(), init_keys.size());
+            } else {
+                std::vector<PAYLOAD_TYPE> init_values(init_keys.begin(), init_keys.end());
+                index.bulk_load(init_keys.data(), init_values.data(), init_keys.size());
+            }
         }
+        double bulk_load_seconds = phase_seconds();
+
+        printf("Load: read %.3lfs\tsort+shuffle %.3lfs\tinit keys %.3lfs\t%s %.3lfs\n",
+               read_seconds, shuffle_seconds, init_seconds, opened ? "open snapshot" : "bulk_load", bulk_load_seconds);
+        if constexpr (INDEX::HAS_SNAPSHOT) {
+            if (!opened && !snapshot_path.empty()) {
+                INVARIANT(index.save(snapshot_path));
+                printf("Saved snapshot in %.3lfs\n", phase_seconds());
+            }
+        }
+    }
 
-        // COUT_THIS("Bulk loading.");
-        index.bulk_load(init_key_values, init_keys.size());
+    static const std::map<std::string, std::string> &ycsb_workload(const std::string &name) {
+        static const std::map<std::string, std::map<std::string, std::string>> workloads = {
+            {"A", {{"read", "0.5"}, {"update", "0.5"}, {"sample_distribution", "zipf"}}},
+            {"B", {{"read", "0.95"}, {"update", "0.05"}, {"sample_distribution", "zipf"}}},
+            {"C", {{"read", "1"}, {"sample_distribution", "zipf"}}},
+            {"D", {{"read", "0.95"}, {"insert", "0.05"}, {"sample_distribution", "latest"}}},
+            {"E", {{"read", "0"}, {"scan", "0.95"}, {"insert", "0.05"}, {"sample_distribution", "zipf"}}},
+            {"F", {{"read", "0.5"}, {"rmw", "0.5"}, {"sample_distribution", "zipf"}}},
+        };
+        auto it = workloads.find(name);
+        if (it == workloads.end()) {
+            COUT_N_EXIT("unknown --workload, expected A, B, C, D, E or F");
+        }
+        return it->second;
     }
 
     inline void parse_args(int argc, char **argv) {
         auto flags = parse_flags(argc, argv);
+        // --workload=A..F presets the operation mix and request distribution of the
+        // YCSB core workload. Any of --read, --insert, --scan, --delete, --update or
+        // --rmw given with it replaces the whole preset mix, so the given ratios must
+        // add up to 1 on their own; --sample_distribution overrides just itself
+        if (flags.count("workload")) {
+            static const char *const RATIO_FLAGS[] = {"read", "insert", "scan", "delete", "update", "rmw"};
+            auto preset = ycsb_workload(flags["workload"]);
+            for (const char *ratio : RATIO_FLAGS) {
+                if (flags.count(ratio)) {
+                    for (const char *preset_ratio : RATIO_FLAGS) {
+                        preset.erase(preset_ratio);
+                    }
+                    break;
+                }
+            }
+            flags.insert(preset.begin(), preset.end());
+        }
         keys_file_path = get_required(flags, "keys_file");
         keys_file_type = get_with_default(flags, "keys_file_type", "binary");
         read_ratio = stod(get_required(flags, "read"));
         insert_ratio = stod(get_with_default(flags, "insert", "0"));
+        scan_ratio = stod(get_with_default(flags, "scan", "0"));
+        scan_length = stoi(get_with_default(flags, "scan_length", "100"));
+        delete_ratio = stod(get_with_default(flags, "delete", "0"));
+        update_ratio = stod(get_with_default(flags, "update", "0"));
+        rmw_ratio = stod(get_with_default(flags, "rmw", "0"));
         operations_num = stoi(get_with_default(flags, "operations_num", "800000000"));
         table_size = stoi(get_with_default(flags, "table_size", "-1"));
         init_table_ratio = stod(get_with_default(flags, "init_table_ratio", "0.5"));
         init_table_size = -1;
         sample_distribution = get_with_default(flags, "sample_distribution", "uniform");
+        zipf_theta = stod(get_with_default(flags, "zipf_theta", "0.99"));
         latency_sample = get_boolean_flag(flags, "latency_sample");
         latency_sample_ratio = stod(get_with_default(flags, "latency_sample_ratio", "0.01"));
         output_path = get_with_default(flags, "output_path", "./result");
+        monitor_interval = stoi(get_with_default(flags, "monitor_interval", "0"));
+        perf_counters = get_boolean_flag(flags, "perf_counters");
+        pin_threads = get_boolean_flag(flags, "pin_threads");
+        timeline_path = get_with_default(flags, "timeline_path", output_path + ".timeline");
+        snapshot_path = get_with_default(flags, "snapshot", "");
         random_seed = stoul(get_with_default(flags, "seed", "1866"));
         thread_num = stoi(get_with_default(flags, "thread_num", "1"));
+        batch_size = stoi(get_with_default(flags, "batch_size", "1"));
         gen.seed(random_seed);
 
-        double ratio_sum = read_ratio + insert_ratio;
+        double ratio_sum = read_ratio + insert_ratio + scan_ratio + delete_ratio + update_ratio + rmw_ratio;
         INVARIANT(ratio_sum > 0.9999 && ratio_sum < 1.0001);  // avoid precision lost
-        INVARIANT(sample_distribution == "zipf" || sample_distribution == "uniform");
+        INVARIANT(sample_distribution == "zipf" || sample_distribution == "uniform" || sample_distribution == "latest");
+        INVARIANT(zipf_theta >= 0 && zipf_theta < 1);
+        INVARIANT(monitor_interval >= 0);
+        INVARIANT(batch_size >= 1);
+        INVARIANT(scan_length >= 1);
+        INVARIANT(!(latency_sample && batch_size > 1));  // batched reads have no per-op latency
+        INVARIANT(INDEX::HAS_SCAN || scan_ratio == 0);
+        INVARIANT(INDEX::HAS_SNAPSHOT || snapshot_path.empty());
     }
 
     void generate_operations() {
         // COUT_THIS("Generating operations.");
-        operations.reserve(operations_num);
-        KEY_TYPE *sample_ptr = nullptr;
-        if (sample_distribution == "uniform") {
-            sample_ptr = get_search_keys(&init_keys[0], init_table_size, operations_num, &random_seed);
-        } else if (sample_distribution == "zipf") {
-            sample_ptr = get_search_keys_zipf(&init_keys[0], init_table_size, operations_num, &random_seed);
+        const double ratios[NUM_OPERATIONS] = {read_ratio, insert_ratio, delete_ratio, scan_ratio, update_ratio, rmw_ratio};
+        const size_t num_blocks = (operations_num + OPERATION_BLOCK - 1) / OPERATION_BLOCK;
+        op_types.reset(new Operation[operations_num]);
+        op_keys.reset(new KEY_TYPE[operations_num]);
+        std::vector<size_t> block_inserts(num_blocks + 1, 0);
+        const double zetan = ScrambledZipfianGenerator::zeta(init_table_size, zipf_theta);
+
+        // pass 1: operation types, and how many inserts each block takes
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t b = 0; b < num_blocks; ++b) {
+            std::seed_seq seq{random_seed, (size_t) b, (size_t) 0};
+            std::mt19937_64 type_gen(seq);
+            std::uniform_real_distribution<> ratio_dis(0, 1);
+            size_t inserts = 0;
+            for (size_t i = b * OPERATION_BLOCK; i < std::min(operations_num, (b + 1) * OPERATION_BLOCK); ++i) {
+                double prob = ratio_dis(type_gen);
+                int op = 0;
+                while (op + 1 < NUM_OPERATIONS && prob >= ratios[op]) {
+                    prob -= ratios[op];
+                    op++;
+                }
+                op_types[i] = static_cast<Operation>(op);
+                inserts += op == INSERT;
+            }
+            block_inserts[b + 1] = inserts;
         }
 
-        std::uniform_real_distribution<> ratio_dis(0, 1);
-        size_t sample_counter = 0, insert_counter = init_table_size;
+        // inserts take the keys after the initial table in order, stop where they run out
+        for (size_t b = 0; b < num_blocks; ++b) {
+            block_inserts[b + 1] += block_inserts[b];
+        }
+        const size_t insert_keys = table_size - init_table_size;
+        if (block_inserts[num_blocks] > insert_keys) {
+            size_t b = std::upper_bound(block_inserts.begin(), block_inserts.end(), insert_keys) - block_inserts.begin() - 1;
+            size_t inserts = block_inserts[b], i = b * OPERATION_BLOCK;
+            while (op_types[i] != INSERT || inserts++ < insert_keys) {
+                i++;
+            }
+            operations_num = i;
+        }
 
-        for (size_t i = 0; i < operations_num; ++i) {
-            auto prob = ratio_dis(gen);
-            if (prob < read_ratio) {
-                operations.push_back(std::pair<Operation, KEY_TYPE>(READ, sample_ptr[sample_counter++]));
-            } else if (prob < read_ratio + insert_ratio) {
-                if (insert_counter >= table_size) {
-                    operations_num = i;
-                    break;
+        // pass 2: keys, sampled from the initial table or taken from the insert keys
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t b = 0; b < num_blocks; ++b) {
+            std::seed_seq seq{random_seed, (size_t) b, (size_t) 1};
+            std::mt19937_64 sample_gen(seq);
+            std::uniform_int_distribution<size_t> uniform_dis(0, init_table_size - 1);
+            size_t zipf_seed = sample_gen();
+            ScrambledZipfianGenerator zipf_gen(init_table_size, &zipf_seed, zipf_theta, zetan);
+            size_t insert_counter = init_table_size + block_inserts[b];
+            for (size_t i = b * OPERATION_BLOCK; i < std::min(operations_num, (b + 1) * OPERATION_BLOCK); ++i) {
+                if (op_types[i] == INSERT) {
+                    op_keys[i] = keys[insert_counter++];
+                } else if (sample_distribution == "uniform") {
+                    op_keys[i] = init_keys[uniform_dis(sample_gen)];
+                } else if (sample_distribution == "zipf") {
+                    op_keys[i] = init_keys[zipf_gen.nextValue()];
+                } else {  // latest, keys are inserted in the order of the key array
+                    op_keys[i] = keys[insert_counter - 1 - zipf_gen.nextRank()];
                 }
-                operations.push_back(std::pair<Operation, KEY_TYPE>(INSERT, keys[insert_counter++]));
             }
         }
-
-        delete[] sample_ptr;
     }
 
     void run() {
         std::thread *thread_array = new std::thread[thread_num];
-        param_t params[thread_num];
+        std::vector<param_t> params(thread_num);
         TSCNS tn;
         tn.init();
         // printf("Begin running\n");
         auto start_time = tn.rdtsc();
         auto end_time = tn.rdtsc();
+        // once keys get deleted a sampled read may miss, so the existence check is skipped
+        // so may reads of the latest keys, whose insert can still be running on another thread
+        const bool skip_existence_check = delete_ratio > 0 || sample_distribution == "latest";
+        std::atomic<bool> running{true};
+        std::vector<TimelineSample> timeline;
+        std::thread monitor;
+        if (monitor_interval > 0) {
+            monitor = std::thread([&]() { monitor_loop(params, running, timeline); });
+        }
 //        System::profile("perf.data", [&]() {
 #pragma omp parallel num_threads(thread_num)
         {
             // thread specifier
             auto thread_id = omp_get_thread_num();
+            if (pinning) pinning->pin(thread_id);
             // Latency Sample Variable
             int latency_sample_interval = operations_num / (operations_num * latency_sample_ratio);
             auto latency_sample_start_time = tn.rdtsc();
             auto latency_sample_end_time = tn.rdtsc();
             param_t &thread_param = params[thread_id];
-            thread_param.latency.reserve(operations_num / latency_sample_interval);
+            // consecutive reads are collected and looked up together with multi_at()
+            std::vector<KEY_TYPE> batch_keys(batch_size);
+            std::vector<PAYLOAD_TYPE> batch_values(batch_size);
+            size_t batch_count = 0;
+            std::vector<std::pair<KEY_TYPE, PAYLOAD_TYPE>> scan_buffer(scan_length);
+            uint64_t thread_ops = 0;
+            // hardware counters of this thread, counting only the timed loop
+            std::unique_ptr<PerfEvents> perf(perf_counters ? new PerfEvents() : nullptr);
             // waiting all thread ready
 #pragma omp barrier
 #pragma omp master
             start_time = tn.rdtsc();
+            if (perf) perf->start();
 // running benchmark
-#pragma omp for schedule(dynamic, 10000)
+#pragma omp for schedule(dynamic, 10000) nowait
             for (auto i = 0; i < operations_num; i++) {
-                auto op = operations[i].first;
-                auto key = operations[i].second;
+                auto op = op_types[i];
+                auto key = op_keys[i];
 
                 if (latency_sample && i % latency_sample_interval == 0)
                     latency_sample_start_time = tn.rdtsc();
 
-                if (op == READ) {  // get
-                    PAYLOAD_TYPE val = index.at(key, false);
-                    // if(val != key) {
-                    //     printf("read failed, Key %lu, val %llu\n",key, val);
-                    //     exit(1);
-                    // }
-                } else if (op == INSERT) {  // insert
-                    index.insert(key, key);
+                if (op == READ && batch_size > 1) {  // batched get
+                    batch_keys[batch_count++] = key;
+                    if (batch_count == batch_size) {
+                        index.multi_get(&batch_keys[0], &batch_values[0], batch_count);
+                        batch_count = 0;
+                    }
+                } else {
+                    if (batch_count > 0) {  // keep batched reads ordered before other ops
+                        index.multi_get(&batch_keys[0], &batch_values[0], batch_count);
+                        batch_count = 0;
+                    }
+                    if (op == READ) {  // get
+                        PAYLOAD_TYPE val = index.get(key, skip_existence_check);
+                        // if(val != key) {
+                        //     printf("read failed, Key %lu, val %llu\n",key, val);
+                        //     exit(1);
+                        // }
+                    } else if (op == INSERT) {  // insert
+                        index.insert(key, key);
+                    } else if (op == SCAN) {  // short range scan
+                        index.scan(key, scan_length, &scan_buffer[0]);
+                    } else if (op == DELETE) {  // delete
+                        index.erase(key);
+                    } else if (op == UPDATE) {  // in-place update, payload stays equal to the key
+                        index.update(key, key);
+                    } else if (op == READ_MODIFY_WRITE) {  // read, then write the payload back
+                        PAYLOAD_TYPE val = index.get(key, skip_existence_check);
+                        index.update(key, val);
+                    }
                 }
 
                 if (latency_sample && i % latency_sample_interval == 0) {
                     latency_sample_end_time = tn.rdtsc();
-                    thread_param.latency.push_back(std::make_pair(latency_sample_start_time, latency_sample_end_time));
+                    thread_param.latency[op].record(latency_sample_end_time - latency_sample_start_time);
                 }
+                thread_param.ops.store(++thread_ops, std::memory_order_relaxed);
             } // omp for loop
+            if (batch_count > 0) {
+                index.multi_get(&batch_keys[0], &batch_values[0], batch_count);
+            }
+            if (perf) {
+                perf->stop();
+                for (int e = 0; e < PerfEvents::NUM_EVENTS; e++) {
+                    auto event = static_cast<PerfEvents::Event>(e);
+                    thread_param.perf[e] = perf->available(event) ? perf->count(event) : -1;
+                }
+            }
+#pragma omp barrier
 #pragma omp master
             end_time = tn.rdtsc();
         } // all thread join here
+        running = false;
+        if (monitor.joinable()) {
+            monitor.join();
+            print_timeline(timeline);
+        }
 
 //        });
         auto diff = tn.tsc2ns(end_time) - tn.tsc2ns(start_time);
         // printf("Finish running\n");
 
         // gather thread local variable
-        for (auto &p: params) {
-            if (latency_sample) {
-                for (auto e : p.latency) {
-                    stat.latency.push_back(tn.tsc2ns(e.second) - tn.tsc2ns(e.first));
+        if (latency_sample) {
+            for (int op = 0; op < NUM_OPERATIONS; op++) {
+                for (auto &p: params) {
+                    stat.latency[op].merge(p.latency[op]);
+                }
+                stat.all_latency.merge(stat.latency[op]);
+            }
+            stat.ns_per_tick = (tn.tsc2ns(1ll << 30) - tn.tsc2ns(0)) / double(1ll << 30);
+        }
+        if (perf_counters) {
+            for (int e = 0; e < PerfEvents::NUM_EVENTS; e++) {
+                stat.perf[e] = 0;
+                for (auto &p: params) {
+                    stat.perf[e] = p.perf[e] < 0 || stat.perf[e] < 0 ? -1 : stat.perf[e] + p.perf[e];
                 }
             }
         }
@@ -234,42 +465,216 @@ public:
         delete[] thread_array;
     }
 
+    struct TimelineSample {
+        double time; // seconds since the monitor started
+        uint64_t ops;
+        typename INDEX::Metrics metrics;
+    };
+
+    // samples the operations done by all threads and the rebuild counters of the
+    // index every monitor_interval ms, until running is cleared
+    void monitor_loop(const std::vector<param_t> &params, const std::atomic<bool> &running,
+                      std::vector<TimelineSample> &timeline) {
+        auto start = std::chrono::steady_clock::now();
+        auto next = start;
+        timeline.push_back({0, 0, index.get_metrics()});
+        while (running.load()) {
+            next += std::chrono::milliseconds(monitor_interval);
+            std::this_thread::sleep_until(next);
+            TimelineSample sample;
+            sample.time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            sample.ops = 0;
+            for (auto &p: params) {
+                sample.ops += p.ops.load(std::memory_order_relaxed);
+            }
+            sample.metrics = index.get_metrics();
+            timeline.push_back(sample);
+        }
+    }
+
+    // one row per interval: throughput, and the rebuilds and their reallocated bytes in it
+    void print_timeline(const std::vector<TimelineSample> &timeline) {
+        std::ofstream ofile;
+        ofile.open(timeline_path, std::ios::trunc);
+        ofile << "time_ms,ops,throughput,rebuilds,rebuild_keys,rebuild_bytes" << std::endl;
+        for (size_t i = 1; i < timeline.size(); i++) {
+            const TimelineSample &sample = timeline[i], &last = timeline[i - 1];
+            ofile << static_cast<long long>(sample.time * 1000) << ",";
+            ofile << sample.ops - last.ops << ",";
+            ofile << static_cast<uint64_t>((sample.ops - last.ops) / (sample.time - last.time)) << ",";
+            if constexpr (INDEX::HAS_METRICS) {
+                ofile << sample.metrics.rebuild_times() - last.metrics.rebuild_times() << ",";
+                ofile << sample.metrics.rebuild_keys - last.metrics.rebuild_keys << ",";
+                ofile << sample.metrics.rebuild_bytes - last.metrics.rebuild_bytes << std::endl;
+            } else {
+                ofile << ",," << std::endl;
+            }
+        }
+        ofile.close();
+    }
+
+    // a latency in ticks as whole ns
+    uint64_t to_ns(double ticks) const {
+        return std::llround(ticks * stat.ns_per_tick);
+    }
+
+    static void print_latency_header(std::ostream &out, const std::string &name) {
+        for (const char *column : {"p50", "p90", "p99", "p99.9", "p99.99", "max"}) {
+            out << name << "_" << column << ",";
+        }
+    }
+
+    void print_latency(std::ofstream &ofile, const LatencyHistogram &latency) {
+        if (!latency_sample) {
+            ofile << ",,,,,,";
+            return;
+        }
+        for (double q : {0.5, 0.9, 0.99, 0.999, 0.9999}) {
+            ofile << to_ns(latency.percentile(q)) << ",";
+        }
+        ofile << to_ns(latency.max()) << ",";
+    }
+
     void print_stat(bool header = false) {
-        double avg_latency = 0;
-        double latency_variance = 0;
+        printf("Thread: %zu\tThroughput: %lu\tIndex: %s\n", thread_num, stat.throughput, INDEX::name().c_str());
+        if constexpr (INDEX::HAS_METRICS) {
+            auto metrics = index.get_metrics();
+            printf("Garbage backlog: %lld\n", metrics.garbage_backlog);
+            printf("Index: avg lookup depth %.2lf\tolc restarts %lld\trebuilds %lld\trebuild keys %lld\ttwo-key nodes %lld\tebr frees %lld\n",
+                   metrics.lookups == 0 ? 0.0 : double(metrics.lookup_depth) / metrics.lookups, metrics.olc_restarts,
+                   metrics.rebuild_times(), metrics.rebuild_keys, metrics.two_node_creations, metrics.ebr_frees);
+        }
         if (latency_sample) {
-            for (auto t : stat.latency) {
-                avg_latency += t;
-                latency_variance += (t - avg_latency) * (t - avg_latency);
+            for (int op = 0; op < NUM_OPERATIONS; op++) {
+                const LatencyHistogram &latency = stat.latency[op];
+                if (latency.count() > 0) {
+                    printf("Latency %s (ns): samples %lu\tavg %.1lf\tstddev %.1lf\tp50 %lu\tp99 %lu\tp99.99 %lu\tmax %lu\n",
+                           OPERATION_NAMES[op], latency.count(), latency.mean() * stat.ns_per_tick,
+                           std::sqrt(latency.variance()) * stat.ns_per_tick, to_ns(latency.percentile(0.5)),
+                           to_ns(latency.percentile(0.99)), to_ns(latency.percentile(0.9999)), to_ns(latency.max()));
+                }
+            }
+        }
+
+        if (perf_counters) {
+            printf("Per op:");
+            for (int e = 0; e < PerfEvents::NUM_EVENTS; e++) {
+                if (stat.perf[e] < 0) {
+                    printf("\t%s n/a", PerfEvents::EVENT_NAMES[e]);
+                } else {
+                    printf("\t%s %.2lf", PerfEvents::EVENT_NAMES[e], double(stat.perf[e]) / operations_num);
+                }
+            }
+            printf("\n");
+            const long long node_loads = stat.perf[PerfEvents::NODE_LOADS];
+            const long long node_load_misses = stat.perf[PerfEvents::NODE_LOAD_MISSES];
+            if (node_loads > 0 && node_load_misses >= 0) {
+                const double remote = std::min(1.0, double(node_load_misses) / node_loads);
+                printf("Memory loads: local %.1lf%%\tremote %.1lf%%\n", (1 - remote) * 100, remote * 100);
             }
-            avg_latency /= stat.latency.size();
-            latency_variance /= stat.latency.size();
-            std::sort(stat.latency.begin(), stat.latency.end());
         }
 
-        printf("Thread: %zu\tThroughput: %lu\n", thread_num, stat.throughput);
+        // The original columns come first, so rows stay aligned with files written by older builds.
+        std::ostringstream columns;
+        columns << "key_path" << ",";
+        columns << "throughput" << ",";
+        columns << "thread_num" << ",";
+        columns << "latency_avg" << ",";
+        columns << "latency_stddev" << ",";
+        print_latency_header(columns, "latency");
+        for (int op = 0; op < NUM_OPERATIONS; op++) {
+            print_latency_header(columns, OPERATION_NAMES[op]);
+        }
+        for (int e = 0; e < PerfEvents::NUM_EVENTS; e++) {
+            columns << PerfEvents::EVENT_NAMES[e] << "_per_op" << ",";
+        }
+        columns << "index";
 
         if (!file_exists(output_path)) {
             std::ofstream ofile;
             ofile.open(output_path, std::ios::app);
-            ofile << "key_path" << ",";
-            ofile << "throughput" << ",";
-            ofile << "thread_num" << std::endl;
+            ofile << columns.str() << std::endl;
+        } else {
+            std::ifstream ifile(output_path);
+            std::string existing;
+            std::getline(ifile, existing);
+            if (existing != columns.str()) {
+                printf("%s has different columns, not appending to it\n", output_path.c_str());
+                return;
+            }
         }
 
         std::ofstream ofile;
         ofile.open(output_path, std::ios::app);
         ofile << keys_file_path << ",";
         ofile << stat.throughput << ",";
-        ofile << thread_num << std::endl;
+        ofile << thread_num << ",";
+        if (latency_sample) {
+            ofile << stat.all_latency.mean() * stat.ns_per_tick << ",";
+            ofile << std::sqrt(stat.all_latency.variance()) * stat.ns_per_tick << ",";
+        } else {
+            ofile << ",,";
+        }
+        print_latency(ofile, stat.all_latency);
+        for (int op = 0; op < NUM_OPERATIONS; op++) {
+            print_latency(ofile, stat.latency[op]);
+        }
+        for (int e = 0; e < PerfEvents::NUM_EVENTS; e++) {
+            if (perf_counters && stat.perf[e] >= 0) {
+                ofile << double(stat.perf[e]) / operations_num;
+            }
+            ofile << ",";
+        }
+        ofile << INDEX::name() << std::endl;
         ofile.close();
     }
 };
 
-int main(int argc, char **argv) {
-    Benchmark <uint64_t, uint64_t> bench;
+template<typename BENCHMARK>
+void run_benchmark(int argc, char **argv) {
+    auto flags = parse_flags(argc, argv);
+    IndexOptions options;
+    options.background_reclaim = get_boolean_flag(flags, "background_reclaim");
+    // --numa_interleave=<levels> only applies to lipp
+    options.numa_interleave_levels = stoi(get_with_default(flags, "numa_interleave", "0"));
+    INVARIANT(options.numa_interleave_levels >= 0);
+    BENCHMARK bench(options);
     bench.parse_args(argc, argv);
     bench.load_keys();
     bench.generate_operations();
     bench.run();
 }
+
+template<bool FAST_MODEL>
+void run_lipp_benchmark(const std::string &allocator, int argc, char **argv) {
+    if (allocator == "std") {
+        run_benchmark<Benchmark<LippIndex<uint64_t, uint64_t, StdAllocPolicy, FAST_MODEL>>>(argc, argv);
+    } else if (allocator == "slab") {
+        run_benchmark<Benchmark<LippIndex<uint64_t, uint64_t, SlabAllocPolicy<false>, FAST_MODEL>>>(argc, argv);
+    } else if (allocator == "slab_huge") {
+        run_benchmark<Benchmark<LippIndex<uint64_t, uint64_t, SlabAllocPolicy<true>, FAST_MODEL>>>(argc, argv);
+    } else {
+        COUT_N_EXIT("unknown --allocator, expected std, slab or slab_huge");
+    }
+}
+
+int main(int argc, char **argv) {
+    auto flags = parse_flags(argc, argv);
+    // --allocator and --model only apply to lipp
+    std::string index = get_with_default(flags, "index", "lipp");
+    std::string allocator = get_with_default(flags, "allocator", "slab");
+    std::string model = get_with_default(flags, "model", "fast");
+    if (index == "map") {
+        run_benchmark<Benchmark<LockedMapIndex<uint64_t, uint64_t>>>(argc, argv);
+    } else if (index == "tbb_hash") {
+        run_benchmark<Benchmark<TbbHashIndex<uint64_t, uint64_t>>>(argc, argv);
+    } else if (index != "lipp") {
+        COUT_N_EXIT("unknown --index, expected lipp, map or tbb_hash");
+    } else if (model == "fast") {
+        run_lipp_benchmark<true>(allocator, argc, argv);
+    } else if (model == "long_double") {
+        run_lipp_benchmark<false>(allocator, argc, argv);
+    } else {
+        COUT_N_EXIT("unknown --model, expected fast or long_double");
+    }
+}
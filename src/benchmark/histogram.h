@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// Log-bucketed latency histogram in the spirit of HdrHistogram.
+// Values below 2^SUB_BITS are counted exactly, larger ones in buckets of
+// 2^SUB_BITS per power of two, so a reported value is within 1/2^SUB_BITS
+// (about 3%) of the recorded one. Recording is a few instructions and the
+// memory is fixed, so every sampled operation can be kept.
+class LatencyHistogram {
+    static constexpr int SUB_BITS = 5;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t total = 0;
+    uint64_t max_value = 0;
+    // running mean and sum of squared differences (Welford)
+    double mean_value = 0;
+    double m2 = 0;
+
+    static int bucket_of(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<int>(value);
+        }
+        const int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<int>((value >> shift) - SUB_BUCKETS);
+    }
+
+    // largest value that falls into the bucket
+    static uint64_t bucket_high(int bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        const int shift = bucket / SUB_BUCKETS - 1;
+        const uint64_t low = uint64_t(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+        return low + ((uint64_t(1) << shift) - 1);
+    }
+
+public:
+    LatencyHistogram() {
+        memset(counts, 0, sizeof(counts));
+    }
+
+    void record(uint64_t value) {
+        counts[bucket_of(value)]++;
+        total++;
+        max_value = std::max(max_value, value);
+        const double delta = value - mean_value;
+        mean_value += delta / total;
+        m2 += delta * (value - mean_value);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        if (other.total == 0) {
+            return;
+        }
+        for (int b = 0; b < NUM_BUCKETS; b++) {
+            counts[b] += other.counts[b];
+        }
+        const uint64_t merged = total + other.total;
+        const double delta = other.mean_value - mean_value;
+        m2 += other.m2 + delta * delta * (double(total) * other.total / merged);
+        mean_value += delta * other.total / merged;
+        total = merged;
+        max_value = std::max(max_value, other.max_value);
+    }
+
+    uint64_t count() const { return total; }
+
+    uint64_t max() const { return max_value; }
+
+    double mean() const { return mean_value; }
+
+    double variance() const { return total == 0 ? 0 : m2 / total; }
+
+    // smallest bucket bound that at least a fraction q of the values are below
+    uint64_t percentile(double q) const {
+        if (total == 0) {
+            return 0;
+        }
+        const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * total)));
+        uint64_t seen = 0;
+        for (int b = 0; b < NUM_BUCKETS; b++) {
+            seen += counts[b];
+            if (seen >= rank) {
+                return std::min(bucket_high(b), max_value);
+            }
+        }
+        return max_value;
+    }
+};
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+
+#include "tbb/concurrent_hash_map.h"
+#include "tbb/parallel_for.h"
+#include "utils.h"
+
+#include "../core/lipp.h"
+
+// Index adapters give the benchmark one interface to LIPP and to the baseline
+// structures it is compared against, so all of them run the same operation
+// stream. An adapter is a class with
+//
+//   typedef ... key_type;
+//   typedef ... payload_type;
+//   static constexpr bool HAS_SCAN;      // scan() is supported
+//   static constexpr bool HAS_METRICS;   // get_metrics() reports index internals
+//   static constexpr bool HAS_SNAPSHOT;  // save() and open() are supported
+//   struct Metrics;
+//
+//   explicit Adapter(const IndexOptions &options);
+//   static std::string name();
+//   void bulk_load(const key_type *keys, const payload_type *values, size_t n); // sorted keys
+//   payload_type get(const key_type &key, bool skip_existence_check) const;
+//   void multi_get(const key_type *keys, payload_type *out, size_t n) const;
+//   bool insert(const key_type &key, const payload_type &value);   // false if present
+//   bool update(const key_type &key, const payload_type &value);   // false if absent
+//   bool erase(const key_type &key);                               // false if absent
+//   int scan(const key_type &lo, int n, std::pair<key_type, payload_type> *out) const;
+//   Metrics get_metrics() const;
+//   bool save(const std::string &path) const;  // only with HAS_SNAPSHOT
+//   bool open(const std::string &path, const key_type *keys, size_t n); // replaces the contents,
+//                                              // false if path is no snapshot of these sorted keys
+//
+// All members but bulk_load() may be called by several threads at once.
+// get() aborts on a missing key unless skip_existence_check is set, then it
+// returns whatever the index yields for it.
+
+// options of the index under test, adapters ignore the ones they have no use for
+struct IndexOptions {
+    bool background_reclaim = false; // LIPP runs the deleters of retired nodes on a thread of its own
+    int numa_interleave_levels = 0;  // LIPP spreads the nodes of this many top levels over the NUMA nodes
+};
+
+template<typename KEY_TYPE, typename PAYLOAD_TYPE, typename ALLOC_POLICY = SlabAllocPolicy<>, bool FAST_MODEL = true>
+class LippIndex {
+    typedef LIPP<KEY_TYPE, PAYLOAD_TYPE, true, ALLOC_POLICY, FAST_MODEL> Index;
+    Index index;
+
+public:
+    typedef KEY_TYPE key_type;
+    typedef PAYLOAD_TYPE payload_type;
+    typedef typename Index::Metrics Metrics;
+    static constexpr bool HAS_SCAN = true;
+    static constexpr bool HAS_METRICS = true;
+    static constexpr bool HAS_SNAPSHOT = true;
+
+    explicit LippIndex(const IndexOptions &options)
+        : index(0, true, 16384, 4096, options.background_reclaim, options.numa_interleave_levels) {}
+
+    static std::string name() {
+        return FAST_MODEL ? "lipp" : "lipp_long_double";
+    }
+
+    void bulk_load(const KEY_TYPE *keys, const PAYLOAD_TYPE *values, size_t n) {
+        index.bulk_load(keys, values, n);
+    }
+
+    PAYLOAD_TYPE get(const KEY_TYPE &key, bool skip_existence_check) const {
+        return index.at(key, skip_existence_check);
+    }
+
+    void multi_get(const KEY_TYPE *keys, PAYLOAD_TYPE *out, size_t n) const {
+        index.multi_at(keys, out, n);
+    }
+
+    bool insert(const KEY_TYPE &key, const PAYLOAD_TYPE &value) {
+        return index.insert(key, value);
+    }
+
+    bool update(const KEY_TYPE &key, const PAYLOAD_TYPE &value) {
+        return index.update(key, value);
+    }
+
+    bool erase(const KEY_TYPE &key) {
+        return index.erase(key);
+    }
+
+    int scan(const KEY_TYPE &lo, int n, std::pair<KEY_TYPE, PAYLOAD_TYPE> *out) const {
+        return index.range_scan(lo, n, out);
+    }
+
+    Metrics get_metrics() const {
+        return index.get_metrics();
+    }
+
+    bool save(const std::string &path) const {
+        return index.save(path.c_str());
+    }
+
+    bool open(const std::string &path, const KEY_TYPE *keys, size_t n) {
+        return index.open(path.c_str(), keys, n);
+    }
+};
+
+// std::map behind a reader-writer lock: the ordered baseline without any
+// concurrency of its own
+template<typename KEY_TYPE, typename PAYLOAD_TYPE>
+class LockedMapIndex {
+    std::map<KEY_TYPE, PAYLOAD_TYPE> map;
+    mutable std::shared_mutex mutex;
+
+public:
+    typedef KEY_TYPE key_type;
+    typedef PAYLOAD_TYPE payload_type;
+    struct Metrics {};
+    static constexpr bool HAS_SCAN = true;
+    static constexpr bool HAS_METRICS = false;
+    static constexpr bool HAS_SNAPSHOT = false;
+
+    explicit LockedMapIndex(const IndexOptions &options) {}
+
+    static std::string name() {
+        return "map";
+    }
+
+    void bulk_load(const KEY_TYPE *keys, const PAYLOAD_TYPE *values, size_t n) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        map.clear();
+        for (size_t i = 0; i < n; i++) {
+            map.emplace_hint(map.end(), keys[i], values[i]);
+        }
+    }
+
+    PAYLOAD_TYPE get(const KEY_TYPE &key, bool skip_existence_check) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = map.find(key);
+        if (it == map.end()) {
+            INVARIANT(skip_existence_check);
+            return PAYLOAD_TYPE();
+        }
+        return it->second;
+    }
+
+    // one lock for the whole batch
+    void multi_get(const KEY_TYPE *keys, PAYLOAD_TYPE *out, size_t n) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        for (size_t i = 0; i < n; i++) {
+            auto it = map.find(keys[i]);
+            out[i] = it == map.end() ? PAYLOAD_TYPE() : it->second;
+        }
+    }
+
+    bool insert(const KEY_TYPE &key, const PAYLOAD_TYPE &value) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return map.emplace(key, value).second;
+    }
+
+    bool update(const KEY_TYPE &key, const PAYLOAD_TYPE &value) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = map.find(key);
+        if (it == map.end()) {
+            return false;
+        }
+        it->second = value;
+        return true;
+    }
+
+    bool erase(const KEY_TYPE &key) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return map.erase(key) > 0;
+    }
+
+    int scan(const KEY_TYPE &lo, int n, std::pair<KEY_TYPE, PAYLOAD_TYPE> *out) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        int count = 0;
+        for (auto it = map.lower_bound(lo); it != map.end() && count < n; ++it) {
+            out[count++] = *it;
+        }
+        return count;
+    }
+
+    Metrics get_metrics() const {
+        return {};
+    }
+};
+
+// tbb::concurrent_hash_map: the baseline for point operations, it has no order
+// and so no scan
+template<typename KEY_TYPE, typename PAYLOAD_TYPE>
+class TbbHashIndex {
+    typedef tbb::concurrent_hash_map<KEY_TYPE, PAYLOAD_TYPE> Map;
+    Map map;
+
+public:
+    typedef KEY_TYPE key_type;
+    typedef PAYLOAD_TYPE payload_type;
+    struct Metrics {};
+    static constexpr bool HAS_SCAN = false;
+    static constexpr bool HAS_METRICS = false;
+    static constexpr bool HAS_SNAPSHOT = false;
+
+    explicit TbbHashIndex(const IndexOptions &options) {}
+
+    static std::string name() {
+        return "tbb_hash";
+    }
+
+    void bulk_load(const KEY_TYPE *keys, const PAYLOAD_TYPE *values, size_t n) {
+        map.clear();
+        map.rehash(n);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, n), [&](const tbb::blocked_range<size_t> &r) {
+            for (size_t i = r.begin(); i < r.end(); i++) {
+                map.insert(std::make_pair(keys[i], values[i]));
+            }
+        });
+    }
+
+    PAYLOAD_TYPE get(const KEY_TYPE &key, bool skip_existence_check) const {
+        typename Map::const_accessor accessor;
+        if (!map.find(accessor, key)) {
+            INVARIANT(skip_existence_check);
+            return PAYLOAD_TYPE();
+        }
+        return accessor->second;
+    }
+
+    void multi_get(const KEY_TYPE *keys, PAYLOAD_TYPE *out, size_t n) const {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = get(keys[i], true);
+        }
+    }
+
+    bool insert(const KEY_TYPE &key, const PAYLOAD_TYPE &value) {
+        return map.insert(std::make_pair(key, value));
+    }
+
+    bool update(const KEY_TYPE &key, const PAYLOAD_TYPE &value) {
+        typename Map::accessor accessor;
+        if (!map.find(accessor, key)) {
+            return false;
+        }
+        accessor->second = value;
+        return true;
+    }
+
+    bool erase(const KEY_TYPE &key) {
+        return map.erase(key);
+    }
+
+    int scan(const KEY_TYPE &lo, int n, std::pair<KEY_TYPE, PAYLOAD_TYPE> *out) const {
+        return 0;
+    }
+
+    Metrics get_metrics() const {
+        return {};
+    }
+};
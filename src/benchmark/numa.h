@@ -0,0 +1,120 @@
+#pragma once
+
+#include <sched.h>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tbb/task_scheduler_observer.h"
+
+// Pins threads to CPUs taken round robin from the NUMA nodes, so that n threads
+// are spread evenly over the sockets. Benchmark threads pin themselves with pin();
+// TBB workers are pinned when they join the scheduler after observe(true), so the
+// memory they touch first, e.g. in a parallel bulk load, is spread the same way.
+// TBB workers take the positions from first_worker on, so with first_worker set to
+// the number of benchmark threads they do not share CPUs with them.
+// The nodes are listed in /sys/devices/system/node/online (their ids may have gaps)
+// and the CPUs of each come from its cpulist, restricted to the affinity mask of
+// the process; without that directory all CPUs are one node.
+class ThreadPinning : public tbb::task_scheduler_observer {
+public:
+    explicit ThreadPinning(size_t first_worker = 0) : next_worker(first_worker) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+
+        std::vector<std::vector<int>> node_cpus;
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string nodes;
+        std::getline(online, nodes);
+        for (int node : parse_cpu_list(nodes)) {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!file) {
+                continue;
+            }
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus;
+            for (int cpu : parse_cpu_list(list)) {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                    cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty()) {
+                node_cpus.push_back(cpus);
+            }
+        }
+        if (node_cpus.empty()) {
+            node_cpus.emplace_back();
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &allowed)) {
+                    node_cpus[0].push_back(cpu);
+                }
+            }
+        }
+        num_nodes_ = node_cpus.size();
+
+        for (size_t i = 0; order.size() < count_cpus(node_cpus); i++) {
+            for (auto &cpus : node_cpus) {
+                if (i < cpus.size()) {
+                    order.push_back(cpus[i]);
+                }
+            }
+        }
+    }
+
+    int num_nodes() const { return num_nodes_; }
+
+    int num_cpus() const { return order.size(); }
+
+    // pin the calling thread to the i-th CPU of the round robin order
+    void pin(size_t i) const {
+        if (order.empty()) {
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(order[i % order.size()], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    void on_scheduler_entry(bool worker) override {
+        if (worker) {
+            pin(next_worker.fetch_add(1));
+        }
+    }
+
+private:
+    std::vector<int> order;
+    int num_nodes_ = 1;
+    std::atomic<size_t> next_worker;
+
+    static size_t count_cpus(const std::vector<std::vector<int>> &node_cpus) {
+        size_t n = 0;
+        for (auto &cpus : node_cpus) {
+            n += cpus.size();
+        }
+        return n;
+    }
+
+    // "0-3,8,10-11", the format of both the cpu and the node lists
+    static std::vector<int> parse_cpu_list(const std::string &list) {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ',')) {
+            if (range.empty()) {
+                continue;
+            }
+            const size_t dash = range.find('-');
+            const int first = std::stoi(range.substr(0, dash));
+            const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstring>
+
+// Hardware counters of the calling thread, read through perf_event_open.
+// Every event is opened on its own so that a PMU with few counters can
+// multiplex them; the counts are scaled by the time each one was running.
+// Events the machine or perf_event_paranoid do not allow stay unavailable,
+// only user space is counted.
+class PerfEvents {
+public:
+    enum Event {
+        CYCLES = 0, INSTRUCTIONS, LLC_MISSES, DTLB_MISSES, BRANCH_MISSES, NODE_LOADS, NODE_LOAD_MISSES, NUM_EVENTS
+    };
+
+    // node loads are the loads served from memory, node load misses the ones of
+    // them that went to a remote NUMA node
+    static constexpr const char *EVENT_NAMES[NUM_EVENTS] = {
+        "cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses", "node_loads", "node_load_misses"
+    };
+
+    PerfEvents() {
+        for (int e = 0; e < NUM_EVENTS; e++) {
+            fds[e] = open_event(static_cast<Event>(e));
+            counts[e] = 0;
+        }
+    }
+
+    ~PerfEvents() {
+        for (int e = 0; e < NUM_EVENTS; e++) {
+            if (fds[e] >= 0) {
+                close(fds[e]);
+            }
+        }
+    }
+
+    PerfEvents(const PerfEvents &) = delete;
+    PerfEvents &operator=(const PerfEvents &) = delete;
+
+    bool available(Event e) const { return fds[e] >= 0; }
+
+    void start() {
+        for (int e = 0; e < NUM_EVENTS; e++) {
+            if (fds[e] >= 0) {
+                ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    // stops counting and keeps the counts since start()
+    void stop() {
+        for (int e = 0; e < NUM_EVENTS; e++) {
+            if (fds[e] >= 0) {
+                ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+                counts[e] = read_scaled(fds[e]);
+            }
+        }
+    }
+
+    uint64_t count(Event e) const { return counts[e]; }
+
+private:
+    int fds[NUM_EVENTS];
+    uint64_t counts[NUM_EVENTS];
+
+    static int open_event(Event e) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        switch (e) {
+            case CYCLES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                break;
+            case INSTRUCTIONS:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                break;
+            case LLC_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+            case DTLB_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+            case BRANCH_MISSES:
+                attr.type = PERF_TYPE_HARDWARE;
+                attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                break;
+            case NODE_LOADS:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_NODE | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16);
+                break;
+            case NODE_LOAD_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_NODE | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+            default:
+                return -1;
+        }
+        // this thread, any cpu
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    static uint64_t read_scaled(int fd) {
+        uint64_t values[3]; // value, time enabled, time running
+        if (read(fd, values, sizeof(values)) != sizeof(values) || values[2] == 0) {
+            return 0;
+        }
+        return static_cast<uint64_t>(double(values[0]) * values[1] / values[2]);
+    }
+};
@@ -7,6 +7,7 @@
 #include <functional>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -14,6 +15,7 @@
 #include "zipf.h"
 #include "omp.h"
 #include <cassert>
+#include <charconv>
 #include <chrono>
 #include <cstring>
 #include <fstream>
@@ -139,96 +141,118 @@ struct System {
     }
 };
 
+// The keys are read straight into the array with read(2) rather than through a
+// stream. The caller sorts and shuffles them in place, so it needs a copy of its own anyway.
 template<class T>
 long long load_binary_data(T *&data, long long int length, const std::string &file_path) {
     // open key file
-    std::ifstream is(file_path.c_str(), std::ios::binary | std::ios::in);
-    if (!is.is_open()) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
         return 0;
     }
-
-    // read the number of keys
+    struct stat st;
     T max_size;
-    is.read(reinterpret_cast<char*>(&max_size), sizeof(T));
-
-    // std::cout << max_size << std::endl;
+    if (fstat(fd, &st) != 0 || read(fd, &max_size, sizeof(T)) != (ssize_t) sizeof(T)) {
+        close(fd);
+        return 0;
+    }
 
-    // create array
-    if(length < 0 || length > max_size) length = max_size;
+    // the number of keys, followed by the keys
+    long long num_keys = std::min<long long>(static_cast<long long>(max_size), (st.st_size - sizeof(T)) / sizeof(T));
+    if (length < 0 || length > num_keys) length = num_keys;
     data = new T[length];
 
-    // read keys
-    is.read(reinterpret_cast<char *>(data), std::streamsize(length * sizeof(T)));
-    is.close();
+    // read() returns at most about 2GB at a time
+    char *buffer = reinterpret_cast<char *>(data);
+    size_t remaining = length * sizeof(T);
+    while (remaining > 0) {
+        ssize_t n = read(fd, buffer, remaining);
+        if (n <= 0) {
+            break;
+        }
+        buffer += n;
+        remaining -= n;
+    }
+    close(fd);
+    if (remaining > 0) {
+        delete[] data;
+        data = nullptr;
+        return 0;
+    }
     return length;
 }
 
+// One key per line. The file is mapped and cut into chunks at line boundaries,
+// which are parsed in parallel and concatenated in file order.
 template<class T>
 long long load_text_data(T *&array, long long length, const std::string &file_path) {
-    std::ifstream is(file_path.c_str());
-    if (!is.is_open()) {
+    int fd = open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
         return 0;
     }
-    long long i = 0;
-    std::string str;
-
-    std::vector<T> temp_keys;
-    temp_keys.reserve(200000000);
-    while (std::getline(is, str) && (i < length || length < 0)) {
-        std::istringstream ss(str);
-        T key;
-        ss >> key;
-        temp_keys.push_back(key);
-        i++;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
     }
-
-    array = new T[temp_keys.size()];
-    for(size_t j = 0; j < temp_keys.size(); j++) {
-        array[j] = temp_keys[j];
+    const size_t bytes = st.st_size;
+    if (bytes == 0) {
+        close(fd);
+        array = new T[0];
+        return 0;
     }
-    is.close();
-    return temp_keys.size();
-}
-
-template<class T>
-T *get_search_keys(T array[], int num_keys, int num_searches, size_t *seed = nullptr) {
-    auto *keys = new T[num_searches];
-
-#pragma omp parallel
-    {
-        std::mt19937_64 gen(std::random_device{}());
-        if (seed) {
-            gen.seed(*seed + omp_get_thread_num());
+    void *base = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+    madvise(base, bytes, MADV_SEQUENTIAL);
+    const char *text = static_cast<const char *>(base);
+    const char *text_end = text + bytes;
+
+    const int num_chunks = omp_get_max_threads() * 4;
+    std::vector<std::vector<T>> chunk_keys(num_chunks);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < num_chunks; c++) {
+        // a chunk owns the lines that start inside it
+        const char *p = text + bytes / num_chunks * c;
+        const char *end = c + 1 == num_chunks ? text_end : text + bytes / num_chunks * (c + 1);
+        if (c > 0) {
+            while (p < text_end && p[-1] != '\n') p++;
         }
-        std::uniform_int_distribution<int> dis(0, num_keys - 1);
-#pragma omp for
-        for (int i = 0; i < num_searches; i++) {
-            int pos = dis(gen);
-            keys[i] = array[pos];
+        while (p < end) {
+            const char *eol = static_cast<const char *>(memchr(p, '\n', text_end - p));
+            if (eol == nullptr) eol = text_end;
+            while (p < eol && (*p == ' ' || *p == '\t')) p++;
+            T key;
+            if (p < eol && std::from_chars(p, eol, key).ec == std::errc()) {
+                chunk_keys[c].push_back(key);
+            }
+            p = eol + 1;
         }
     }
+    munmap(base, bytes);
 
-    return keys;
+    std::vector<size_t> offsets(num_chunks + 1, 0);
+    for (int c = 0; c < num_chunks; c++) {
+        offsets[c + 1] = offsets[c] + chunk_keys[c].size();
+    }
+    if (length < 0 || length > (long long) offsets[num_chunks]) length = offsets[num_chunks];
+    array = new T[length];
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < num_chunks; c++) {
+        for (size_t j = 0; j < chunk_keys[c].size() && offsets[c] + j < (size_t) length; j++) {
+            array[offsets[c] + j] = chunk_keys[c][j];
+        }
+    }
+    return length;
 }
 
-
 bool file_exists(const std::string &str) {
     std::ifstream fs(str);
     return fs.is_open();
 }
 
-template<class T>
-T *get_search_keys_zipf(T array[], int num_keys, int num_searches, size_t *seed = nullptr) {
-    auto *keys = new T[num_searches];
-    ScrambledZipfianGenerator zipf_gen(num_keys, seed);
-    for (int i = 0; i < num_searches; i++) {
-        int pos = zipf_gen.nextValue();
-        keys[i] = array[pos];
-    }
-    return keys;
-}
-
-
 template<typename T>
 T *unique_data(T *key1, size_t &size1, T *key2, size_t &size2) {
     size_t ptr1 = 0;
@@ -1,5 +1,7 @@
 // Copyright (c) Microsoft Corporation.
 // Licensed under the MIT license.
+#include <algorithm>
+#include <cmath>
 #include <iomanip>
 #include <fstream>
 #include <iostream>
@@ -12,47 +14,71 @@
 
 class ScrambledZipfianGenerator {
  public:
-  static constexpr double ZETAN = 26.46902820178302;
   static constexpr double ZIPFIAN_CONSTANT = 0.99;
+  // zeta(n) is summed exactly up to this many terms, and approximated beyond
+  static constexpr long ZETA_EXACT_TERMS = 1 << 12;
 
   int num_keys_;
+  double theta_;
+  double zetan_;
   double alpha_;
   double eta_;
   std::mt19937_64 gen_;
   std::uniform_real_distribution<double> dis_;
 
-  explicit ScrambledZipfianGenerator(int num_keys, size_t *seed)
-      : num_keys_(num_keys), gen_(std::random_device{}()), dis_(0, 1) {
+  explicit ScrambledZipfianGenerator(int num_keys, size_t *seed, double theta = ZIPFIAN_CONSTANT)
+      : ScrambledZipfianGenerator(num_keys, seed, theta, zeta(num_keys, theta)) {}
+
+  // zetan must be zeta(num_keys, theta), computing it once saves the sum when
+  // many generators of the same distribution are created
+  ScrambledZipfianGenerator(int num_keys, size_t *seed, double theta, double zetan)
+      : num_keys_(num_keys), theta_(theta), zetan_(zetan), gen_(std::random_device{}()), dis_(0, 1) {
     if(seed) {
       gen_.seed(*seed);
     }
-    double zeta2theta = zeta(2);
-    alpha_ = 1. / (1. - ZIPFIAN_CONSTANT);
-    eta_ = (1 - std::pow(2. / num_keys_, 1 - ZIPFIAN_CONSTANT)) /
-           (1 - zeta2theta / ZETAN);
+    double zeta2theta = zeta(2, theta_);
+    alpha_ = 1. / (1. - theta_);
+    eta_ = (1 - std::pow(2. / num_keys_, 1 - theta_)) /
+           (1 - zeta2theta / zetan_);
   }
 
   int nextValue() {
+    return fnv1a(nextRank()) % num_keys_;
+  }
+
+  // the popularity rank of the next item, 0 is the most popular one
+  int nextRank() {
     double u = dis_(gen_);
-    double uz = u * ZETAN;
+    double uz = u * zetan_;
 
     int ret;
     if (uz < 1.0) {
       ret = 0;
-    } else if (uz < 1.0 + std::pow(0.5, ZIPFIAN_CONSTANT)) {
+    } else if (uz < 1.0 + std::pow(0.5, theta_)) {
       ret = 1;
     } else {
       ret = (int)(num_keys_ * std::pow(eta_ * u - eta_ + 1, alpha_));
     }
 
-    ret = fnv1a(ret) % num_keys_;
-    return ret;
+    return std::min(ret, num_keys_ - 1);
   }
 
-  double zeta(long n) {
+  // sum of 1 / i^theta for i = 1..n. The tail after ZETA_EXACT_TERMS terms is
+  // taken from the Euler-Maclaurin formula, which is accurate to far below the
+  // precision of a double there, so large n cost no more than small ones.
+  static double zeta(long n, double theta) {
+    const long m = std::min(n, ZETA_EXACT_TERMS);
     double sum = 0.0;
-    for (long i = 0; i < n; i++) {
-      sum += 1 / std::pow(i + 1, ZIPFIAN_CONSTANT);
+    for (long i = 0; i < m; i++) {
+      sum += 1 / std::pow(i + 1, theta);
+    }
+    if (n > m) {
+      // sum over i = m+1..n of f(i), with f(x) = x^-theta
+      auto f = [theta](double x) { return std::pow(x, -theta); };
+      auto df = [theta](double x) { return -theta * std::pow(x, -theta - 1); };
+      const double integral = theta == 1 ? std::log(double(n) / m)
+                                         : (std::pow(double(n), 1 - theta) - std::pow(double(m), 1 - theta)) / (1 - theta);
+      sum += integral + (f(n) - f(m)) / 2 + (df(n) - df(m)) / 12;
     }
     return sum;
   }
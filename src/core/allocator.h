@@ -0,0 +1,304 @@
+#ifndef __LIPP_ALLOCATOR_H__
+#define __LIPP_ALLOCATOR_H__
+
+#include "concurrency.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Allocation policies for the nodes, items and bitmaps of LIPP.
+// A policy is a class with static members only:
+//
+//   static void* allocate(size_t bytes);
+//   static void deallocate(void* ptr, size_t bytes);
+//   static void deallocate_bulk(const AllocBlock* blocks, size_t n);
+//
+// It is stateless on purpose: nodes unlinked from a live tree are released by
+// the epoch based reclamation, which only keeps a plain function pointer.
+// allocate() returns (void*)(-1) or NULL on failure, both are checked by LIPP.
+// A block whose size is a multiple of 64 bytes has to start on a cache line,
+// nodes are cache line aligned.
+
+struct AllocBlock {
+    void* ptr;
+    size_t bytes;
+};
+
+// plain operator new/delete, the behaviour of std::allocator, on cache lines
+struct StdAllocPolicy {
+    static constexpr std::align_val_t ALIGNMENT{64};
+
+    static void* allocate(size_t bytes) {
+        return ::operator new(bytes, ALIGNMENT);
+    }
+
+    static void deallocate(void* ptr, size_t bytes) {
+        ::operator delete(ptr, ALIGNMENT);
+    }
+
+    static void deallocate_bulk(const AllocBlock* blocks, size_t n) {
+        for (size_t i = 0; i < n; i ++) {
+            ::operator delete(blocks[i].ptr, ALIGNMENT);
+        }
+    }
+};
+
+// Size-class slab allocator.
+// Requests up to MAX_SMALL bytes are rounded to one of NUM_CLASSES size classes
+// (16 byte steps up to 128, then four classes per power of two) and carved out of
+// SLAB_SIZE mappings. Every thread keeps a cache of free blocks per class and only
+// goes to the shared depot of that class, under a spin_lock, to move a whole batch.
+// Larger requests get a mapping of their own. Slab memory is kept for reuse and
+// never returned to the OS. Classes from 256 bytes on are multiples of 64, so a
+// request of a multiple of 64 bytes gets a class whose blocks start on cache lines.
+// With HUGE_PAGES, slabs and large mappings are 2MB aligned and advised as
+// transparent huge pages.
+template<bool HUGE_PAGES = false>
+class SlabAllocPolicy {
+    static constexpr size_t SLAB_SIZE = 2 << 20;
+    static constexpr size_t MAX_SMALL = 64 << 10;
+    static constexpr int NUM_CLASSES = 44;
+    static constexpr size_t PAGE_SIZE = 4096;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct FreeList {
+        FreeBlock* head = NULL;
+        size_t count = 0;
+
+        void push(void* ptr) {
+            FreeBlock* block = static_cast<FreeBlock*>(ptr);
+            block->next = head;
+            head = block;
+            count ++;
+        }
+
+        void* pop() {
+            FreeBlock* block = head;
+            head = block->next;
+            count --;
+            return block;
+        }
+
+        // move n blocks to the front of other
+        void move_to(FreeList& other, size_t n) {
+            for (size_t i = 0; i < n && head != NULL; i ++) {
+                other.push(pop());
+            }
+        }
+    };
+
+    struct alignas(64) Depot {
+        spin_lock lock;
+        FreeList free_list;
+        char* slab_begin = NULL; // uncarved part of the current slab
+        char* slab_end = NULL;
+    };
+
+    struct ThreadCache {
+        FreeList lists[NUM_CLASSES];
+
+        ~ThreadCache() {
+            for (int c = 0; c < NUM_CLASSES; c ++) {
+                Depot& depot = depots()[c];
+                depot.lock.lock();
+                lists[c].move_to(depot.free_list, lists[c].count);
+                depot.lock.unlock();
+            }
+        }
+    };
+
+    static Depot* depots() {
+        static Depot instance[NUM_CLASSES];
+        return instance;
+    }
+
+    static ThreadCache& thread_cache() {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+    static int size_class(size_t bytes) {
+        if (bytes <= 128) {
+            return bytes == 0 ? 0 : static_cast<int>((bytes + 15) / 16 - 1);
+        }
+        const int k = 63 - __builtin_clzll(bytes - 1);
+        const size_t step = size_t(1) << (k - 2);
+        return 8 + (k - 7) * 4 + static_cast<int>((bytes - 1 - (size_t(1) << k)) / step);
+    }
+
+    static size_t class_size(int c) {
+        if (c < 8) {
+            return (c + 1) * 16;
+        }
+        const int k = 7 + (c - 8) / 4;
+        return (size_t(1) << k) + ((c - 8) % 4 + 1) * (size_t(1) << (k - 2));
+    }
+
+    // blocks moved between a thread cache and the depot at once
+    static size_t batch_size(int c) {
+        return std::max<size_t>(2, std::min<size_t>(64, MAX_SMALL / class_size(c)));
+    }
+
+    static size_t mapping_size(size_t bytes) {
+        const size_t align = HUGE_PAGES ? SLAB_SIZE : PAGE_SIZE;
+        return (bytes + align - 1) / align * align;
+    }
+
+    static void* map(size_t bytes) {
+        if (!HUGE_PAGES) {
+            return mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+        // over-map so that the region can be trimmed to a 2MB boundary
+        char* raw = static_cast<char*>(mmap(NULL, bytes + SLAB_SIZE, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) {
+            return MAP_FAILED;
+        }
+        char* aligned = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(raw) + SLAB_SIZE - 1) / SLAB_SIZE * SLAB_SIZE);
+        if (aligned != raw) {
+            munmap(raw, aligned - raw);
+        }
+        munmap(aligned + bytes, raw + SLAB_SIZE - aligned);
+        madvise(aligned, bytes, MADV_HUGEPAGE);
+        return aligned;
+    }
+
+    // refill an empty thread cache list from the depot, carving a new slab if needed
+    static bool refill(int c, FreeList& list) {
+        const size_t size = class_size(c);
+        const size_t batch = batch_size(c);
+        Depot& depot = depots()[c];
+        depot.lock.lock();
+        depot.free_list.move_to(list, batch);
+        while (list.count < batch) {
+            if (depot.slab_begin + size > depot.slab_end) {
+                char* slab = static_cast<char*>(map(SLAB_SIZE));
+                if (slab == MAP_FAILED) {
+                    break;
+                }
+                depot.slab_begin = slab;
+                depot.slab_end = slab + SLAB_SIZE;
+            }
+            list.push(depot.slab_begin);
+            depot.slab_begin += size;
+        }
+        depot.lock.unlock();
+        return list.count > 0;
+    }
+
+    // return the surplus of an overfull thread cache list to the depot
+    static void spill(int c, FreeList& list) {
+        const size_t batch = batch_size(c);
+        if (list.count <= batch * 2) {
+            return;
+        }
+        Depot& depot = depots()[c];
+        depot.lock.lock();
+        list.move_to(depot.free_list, list.count - batch);
+        depot.lock.unlock();
+    }
+
+public:
+    static void* allocate(size_t bytes) {
+        if (bytes > MAX_SMALL) {
+            return map(mapping_size(bytes));
+        }
+        const int c = size_class(bytes);
+        FreeList& list = thread_cache().lists[c];
+        if (list.head == NULL && !refill(c, list)) {
+            return MAP_FAILED;
+        }
+        return list.pop();
+    }
+
+    static void deallocate(void* ptr, size_t bytes) {
+        if (bytes > MAX_SMALL) {
+            munmap(ptr, mapping_size(bytes));
+            return;
+        }
+        const int c = size_class(bytes);
+        FreeList& list = thread_cache().lists[c];
+        list.push(ptr);
+        spill(c, list);
+    }
+
+    // release many blocks, e.g. a whole subtree, visiting the depot at most once per class
+    static void deallocate_bulk(const AllocBlock* blocks, size_t n) {
+        ThreadCache& cache = thread_cache();
+        uint64_t touched = 0;
+        for (size_t i = 0; i < n; i ++) {
+            if (blocks[i].bytes > MAX_SMALL) {
+                munmap(blocks[i].ptr, mapping_size(blocks[i].bytes));
+                continue;
+            }
+            const int c = size_class(blocks[i].bytes);
+            cache.lists[c].push(blocks[i].ptr);
+            touched |= uint64_t(1) << c;
+        }
+        for (int c = 0; c < NUM_CLASSES; c ++) {
+            if (touched >> c & 1) {
+                spill(c, cache.lists[c]);
+            }
+        }
+    }
+};
+
+// NUMA placement of memory that is already allocated, through the system calls
+// directly so that no libnuma is needed. Only the nodes the process may allocate
+// on are used; on a machine with a single one there is nothing to place.
+struct NumaPlacement {
+    static constexpr unsigned long MAX_NODES = 1024;
+
+    // number of nodes in the mask of allowed nodes, 1 if it cannot be read
+    static int num_nodes() {
+        static const int count = [] {
+            int n = 0;
+            for (unsigned long word : allowed_nodes().mask) {
+                n += __builtin_popcountl(word);
+            }
+            return std::max(n, 1);
+        }();
+        return count;
+    }
+
+    // spread the whole pages of [ptr, ptr + bytes) round robin over the allowed nodes,
+    // pages that are already placed are moved. partial pages at either end stay where
+    // they are, as they are shared with other blocks. false if the kernel refused.
+    static bool interleave(void* ptr, size_t bytes) {
+        const size_t page = sysconf(_SC_PAGESIZE);
+        const uintptr_t begin = (reinterpret_cast<uintptr_t>(ptr) + page - 1) / page * page;
+        const uintptr_t end = (reinterpret_cast<uintptr_t>(ptr) + bytes) / page * page;
+        if (begin >= end || num_nodes() < 2) {
+            return true;
+        }
+        // the kernel reads one bit less than maxnode
+        return syscall(SYS_mbind, begin, end - begin, MPOL_INTERLEAVE, allowed_nodes().mask,
+                       MAX_NODES + 1, MPOL_MF_MOVE) == 0;
+    }
+
+private:
+    struct NodeMask {
+        unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))] = {};
+    };
+
+    static const NodeMask& allowed_nodes() {
+        static const NodeMask nodes = [] {
+            NodeMask m;
+            if (syscall(SYS_get_mempolicy, NULL, m.mask, MAX_NODES, NULL, MPOL_F_MEMS_ALLOWED) != 0) {
+                m = NodeMask();
+            }
+            return m;
+        }();
+        return nodes;
+    }
+};
+
+#endif // __LIPP_ALLOCATOR_H__
@@ -1,32 +1,49 @@
 #ifndef __LIPP_H__
 #define __LIPP_H__
 
+#include "allocator.h"
 #include "concurrency.h"
 #include "lipp_base.h"
 #include "omp.h"
-#include "tbb/combinable.h"
 #include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
+#include "tbb/task_arena.h"
+#include "tbb/task_group.h"
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstdio>
 #include <cstring>
+#include <fcntl.h>
+#include <functional>
 #include <iostream>
 #include <limits>
 #include <list>
 #include <math.h>
 #include <sstream>
 #include <stack>
+#include <string>
 #include <stdint.h>
+#include <sys/stat.h>
 #include <thread>
+#include <unistd.h>
 #include <vector>
 
-typedef uint8_t bitmap_t;
+typedef uint64_t bitmap_t;
 #define BITMAP_WIDTH (sizeof(bitmap_t) * 8)
 #define BITMAP_SIZE(num_items) (((num_items) + BITMAP_WIDTH - 1) / BITMAP_WIDTH)
-#define BITMAP_GET(bitmap, pos) (((bitmap)[(pos) / BITMAP_WIDTH] >> ((pos) % BITMAP_WIDTH)) & 1)
-#define BITMAP_SET(bitmap, pos) ((bitmap)[(pos) / BITMAP_WIDTH] |= 1 << ((pos) % BITMAP_WIDTH))
-#define BITMAP_CLEAR(bitmap, pos) ((bitmap)[(pos) / BITMAP_WIDTH] &= ~bitmap_t(1 << ((pos) % BITMAP_WIDTH)))
-#define BITMAP_NEXT_1(bitmap_item) __builtin_ctz((bitmap_item))
+// The none and child bitmaps of a node are interleaved word by word in front of its
+// items: none[0], child[0], none[1], child[1], ... NONE_BITMAP and CHILD_BITMAP point
+// at the first word of either, the BITMAP_* macros skip the words of the other one.
+#define NONE_BITMAP(node) ((node)->bitmaps)
+#define CHILD_BITMAP(node) ((node)->bitmaps + 1)
+#define BITMAP_WORD(bitmap, pos) ((bitmap)[(pos) / BITMAP_WIDTH * 2])
+#define BITMAP_GET(bitmap, pos) ((BITMAP_WORD(bitmap, pos) >> ((pos) % BITMAP_WIDTH)) & 1)
+#define BITMAP_SET(bitmap, pos) (BITMAP_WORD(bitmap, pos) |= bitmap_t(1) << ((pos) % BITMAP_WIDTH))
+#define BITMAP_CLEAR(bitmap, pos) (BITMAP_WORD(bitmap, pos) &= ~(bitmap_t(1) << ((pos) % BITMAP_WIDTH)))
+#define BITMAP_NEXT_1(bitmap_item) __builtin_ctzll((bitmap_item))
+#define BITMAP_COUNT(bitmap_item) __builtin_popcountll((bitmap_item))
 
 // runtime assert
 #define RT_ASSERT(expr) \
@@ -41,15 +58,15 @@ typedef void (*dealloc_func)(void *ptr);
 
 #define COLLECT_TIME 0
 
-#if COLLECT_TIME
-#include <chrono>
-#endif
 
-template<class T, class P, bool USE_FMCD = true>
+template<class T, class P, bool USE_FMCD = true, class Alloc = StdAllocPolicy, bool USE_FAST_MODEL = true>
 class LIPP
 {
     static_assert(std::is_arithmetic<T>::value, "LIPP key type must be numeric.");
 
+    // bulk builds of at least this many keys are spread over TBB tasks
+    static constexpr int PARALLEL_BUILD_SIZE = 1 << 16;
+
     inline int compute_gap_count(int size) {
         if (size >= 1000000) return 1;
         if (size >= 100000) return 2;
@@ -58,7 +75,12 @@ class LIPP
 
     struct Node;
     inline int PREDICT_POS(Node* node, T key) const {
-        double v = node->model.predict_double(key);
+        if (USE_FAST_MODEL && node->model.fast) {
+            return CLAMP_POS(node, node->model.predict_fast(key));
+        }
+        return CLAMP_POS(node, node->model.predict_double(key));
+    }
+    static inline int CLAMP_POS(const Node* node, double v) {
         if (v > std::numeric_limits<int>::max() / 2) {
             return node->num_items - 1;
         }
@@ -69,33 +91,75 @@ class LIPP
     }
 
     static void remove_last_bit(bitmap_t& bitmap_item) {
-        bitmap_item -= 1 << BITMAP_NEXT_1(bitmap_item);
+        bitmap_item &= bitmap_item - 1;
     }
 
     const double BUILD_LR_REMAIN;
     const bool QUIET;
+    const int SHADOW_REBUILD_SIZE; // subtrees at least this large are rebuilt without blocking writers
+    const int TWO_POOL_HIGH_WATER; // a thread keeps at most this many spare two-key nodes
+    const int NUMA_INTERLEAVE_LEVELS; // slots of the nodes above this depth are interleaved over the NUMA nodes
 
+    #if COLLECT_TIME
     struct {
-        long long fmcd_success_times = 0;
-        long long fmcd_broken_times = 0;
-        #if COLLECT_TIME
         double time_scan_and_destory_tree = 0;
         double time_build_tree_bulk = 0;
-        #endif
     } stats;
+    #endif
+
+    static constexpr int METRIC_LEVELS = 16; // rebuilds deeper than this are counted in the last level
+
+    /// a counter only its own thread writes to, so increments need no atomic
+    /// read-modify-write, and that get_metrics() may read at any time
+    struct Counter {
+        std::atomic<long long> value{0};
+
+        void add(long long n) {
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+        long long get() const {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    struct ThreadCounters {
+        Counter lookups;
+        Counter lookup_depth;
+        Counter olc_restarts;
+        Counter rebuilds[METRIC_LEVELS];
+        Counter rebuild_keys;
+        Counter rebuild_bytes;
+        Counter two_node_creations;
+        Counter fmcd_success_times;
+        Counter fmcd_broken_times;
+        Counter fast_model_rejected_times;
+    };
 
 public:
     // Epoch based Memory Reclaim
+    // Every LIPP owns its own strategy. A thread inside an operation announces the
+    // epoch it entered in its own information, so entering and leaving only write a
+    // cache line no other thread writes; whether the epoch can advance is decided by
+    // a scan over the announcements of all registered threads, which is only done
+    // every 64 scheduled deletions of a thread or by the background reclaimer.
+    // Garbage is freed three epochs after it was scheduled, inline by the thread
+    // that scheduled it, or by a background reclaimer thread when one is enabled.
+    // The per-thread information also holds the thread's counters of the index: its
+    // first cache line is touched by every operation anyway, while a lookup of
+    // thread local counters of their own would often miss.
     class ThreadSpecificEpochBasedReclamationInformation {
-        std::array<std::vector<std::pair<void *, dealloc_func>>, 3> mFreeLists;
-        std::atomic<uint32_t> mLocalEpoch;
+    public:
+        std::atomic<uint32_t> mLocalEpoch; // announced epoch, 3 outside of a critical section
         uint32_t mPreviouslyAccessedEpoch;
         bool mThreadWantsToAdvance;
+        bool mRegistered;
+        ThreadSpecificEpochBasedReclamationInformation *mNextRegistered;
+        ThreadCounters mCounters;
+        std::array<std::vector<std::pair<void *, dealloc_func>>, 3> mFreeLists;
 
-    public:
         ThreadSpecificEpochBasedReclamationInformation()
-            : mFreeLists(), mLocalEpoch(3), mPreviouslyAccessedEpoch(3),
-            mThreadWantsToAdvance(false) {}
+            : mLocalEpoch(3), mPreviouslyAccessedEpoch(3), mThreadWantsToAdvance(false),
+            mRegistered(false), mNextRegistered(nullptr), mCounters(), mFreeLists() {}
 
         ThreadSpecificEpochBasedReclamationInformation(
             ThreadSpecificEpochBasedReclamationInformation const &other) = delete;
@@ -105,44 +169,10 @@ public:
 
         ~ThreadSpecificEpochBasedReclamationInformation() {
             for (uint32_t i = 0; i < 3; ++i) {
-                freeForEpoch(i);
-            }
-        }
-
-        void scheduleForDeletion(std::pair<void *, dealloc_func> func_pair) {
-            assert(mLocalEpoch != 3);
-            std::vector<std::pair<void *, dealloc_func>> &currentFreeList =
-                mFreeLists[mLocalEpoch];
-            currentFreeList.emplace_back(func_pair);
-            mThreadWantsToAdvance = (currentFreeList.size() % 64u) == 0;
-        }
-
-        uint32_t getLocalEpoch() const {
-            return mLocalEpoch.load(std::memory_order_acquire);
-        }
-
-        void enter(uint32_t newEpoch) {
-            assert(mLocalEpoch == 3);
-            if (mPreviouslyAccessedEpoch != newEpoch) {
-                freeForEpoch(newEpoch);
-                mThreadWantsToAdvance = false;
-                mPreviouslyAccessedEpoch = newEpoch;
-            }
-            mLocalEpoch.store(newEpoch, std::memory_order_release);
-        }
-
-        void leave() { mLocalEpoch.store(3, std::memory_order_release); }
-
-        bool doesThreadWantToAdvanceEpoch() { return (mThreadWantsToAdvance); }
-
-    private:
-        void freeForEpoch(uint32_t epoch) {
-            std::vector<std::pair<void *, dealloc_func>> &previousFreeList =
-                mFreeLists[epoch];
-            for (std::pair<void *, dealloc_func> func_pair : previousFreeList) {
-                func_pair.second(func_pair.first);
+                for (std::pair<void *, dealloc_func> func_pair : mFreeLists[i]) {
+                    func_pair.second(func_pair.first);
+                }
             }
-            previousFreeList.resize(0u);
         }
     };
 
@@ -152,6 +182,11 @@ public:
         uint32_t PREVIOUS_EPOCH[3] = {2, 0, 1};
 
         std::atomic<uint32_t> mCurrentEpoch;
+        // every information that was used once, pushed to the front and never removed,
+        // so it can be walked while other threads register
+        std::atomic<ThreadSpecificEpochBasedReclamationInformation *> mRegisteredThreads;
+        std::atomic<long long> mBacklog; // scheduled deletions not run yet
+        std::atomic<long long> mFreed; // deletions run
         tbb::enumerable_thread_specific<
             ThreadSpecificEpochBasedReclamationInformation,
             tbb::cache_aligned_allocator<
@@ -159,138 +194,497 @@ public:
             tbb::ets_key_per_instance>
             mThreadSpecificInformations;
 
-    private:
-        EpochBasedMemoryReclamationStrategy()
-            : mCurrentEpoch(0), mThreadSpecificInformations() {}
+        // background reclaimer, deletions that became safe wait in mReclaimQueue
+        std::thread mReclaimer;
+        std::atomic<bool> mStopReclaimer;
+        spin_lock mReclaimLock;
+        std::vector<std::pair<void *, dealloc_func>> mReclaimQueue;
+
+        explicit EpochBasedMemoryReclamationStrategy(bool backgroundReclaimer = false)
+            : mCurrentEpoch(0), mRegisteredThreads(nullptr), mBacklog(0), mFreed(0),
+            mThreadSpecificInformations(), mStopReclaimer(false) {
+            if (backgroundReclaimer) {
+                mReclaimer = std::thread([this] { reclaimerLoop(); });
+            }
+        }
 
-    public:
-        static EpochBasedMemoryReclamationStrategy *getInstance() {
-        static EpochBasedMemoryReclamationStrategy instance;
-        return &instance;
+        ~EpochBasedMemoryReclamationStrategy() {
+            if (mReclaimer.joinable()) {
+                mStopReclaimer = true;
+                mReclaimer.join();
+            }
+            runDeletions(mReclaimQueue);
         }
 
-        void enterCriticalSection() {
+        // the information of the calling thread, registered on its first use
+        ThreadSpecificEpochBasedReclamationInformation &localInformation() {
             ThreadSpecificEpochBasedReclamationInformation &currentMemoryInformation =
                 mThreadSpecificInformations.local();
-            uint32_t currentEpoch = mCurrentEpoch.load(std::memory_order_acquire);
-            currentMemoryInformation.enter(currentEpoch);
-            if (currentMemoryInformation.doesThreadWantToAdvanceEpoch() &&
-                canAdvance(currentEpoch)) {
+            if (!currentMemoryInformation.mRegistered) {
+                currentMemoryInformation.mRegistered = true;
+                currentMemoryInformation.mNextRegistered = mRegisteredThreads.load();
+                while (!mRegisteredThreads.compare_exchange_weak(
+                    currentMemoryInformation.mNextRegistered, &currentMemoryInformation)) {
+                }
+            }
+            return currentMemoryInformation;
+        }
+
+        ThreadSpecificEpochBasedReclamationInformation &enterCriticalSection() {
+            ThreadSpecificEpochBasedReclamationInformation &currentMemoryInformation =
+                localInformation();
+            assert(currentMemoryInformation.mLocalEpoch.load(std::memory_order_relaxed) == 3);
+            // announce the epoch before using it, and retry if it moved on meanwhile
+            uint32_t currentEpoch = mCurrentEpoch.load();
+            while (true) {
+                currentMemoryInformation.mLocalEpoch.store(currentEpoch);
+                uint32_t epoch = mCurrentEpoch.load();
+                if (epoch == currentEpoch) {
+                    break;
+                }
+                currentEpoch = epoch;
+            }
+            if (currentMemoryInformation.mPreviouslyAccessedEpoch != currentEpoch) {
+                // scheduled three epochs ago, no thread can still see it
+                reclaim(currentMemoryInformation.mFreeLists[currentEpoch]);
+                currentMemoryInformation.mThreadWantsToAdvance = false;
+                currentMemoryInformation.mPreviouslyAccessedEpoch = currentEpoch;
+            }
+            if (currentMemoryInformation.mThreadWantsToAdvance) {
+                tryAdvance(currentEpoch);
+            }
+            return currentMemoryInformation;
+        }
+
+        // no thread is still inside the previous epoch
+        bool canAdvance(uint32_t currentEpoch) {
+            const uint32_t previousEpoch = PREVIOUS_EPOCH[currentEpoch];
+            for (ThreadSpecificEpochBasedReclamationInformation *information =
+                     mRegisteredThreads.load();
+                 information != nullptr; information = information->mNextRegistered) {
+                if (information->mLocalEpoch.load() == previousEpoch) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void tryAdvance(uint32_t currentEpoch) {
+            if (canAdvance(currentEpoch)) {
                 mCurrentEpoch.compare_exchange_strong(currentEpoch,
                                                     NEXT_EPOCH[currentEpoch]);
             }
         }
 
-        bool canAdvance(uint32_t currentEpoch) {
-            uint32_t previousEpoch = PREVIOUS_EPOCH[currentEpoch];
-            return !std::any_of(
-                mThreadSpecificInformations.begin(),
-                mThreadSpecificInformations.end(),
-                [previousEpoch](ThreadSpecificEpochBasedReclamationInformation const
-                                    &threadInformation) {
-                    return (threadInformation.getLocalEpoch() == previousEpoch);
-                });
+        void leaveCriticialSection(
+            ThreadSpecificEpochBasedReclamationInformation &currentMemoryInformation) {
+            currentMemoryInformation.mLocalEpoch.store(3, std::memory_order_release);
         }
 
-        void leaveCriticialSection() {
+        void scheduleForDeletion(std::pair<void *, dealloc_func> func_pair) {
             ThreadSpecificEpochBasedReclamationInformation &currentMemoryInformation =
-                mThreadSpecificInformations.local();
-            currentMemoryInformation.leave();
+                localInformation();
+            const uint32_t localEpoch =
+                currentMemoryInformation.mLocalEpoch.load(std::memory_order_relaxed);
+            assert(localEpoch != 3);
+            std::vector<std::pair<void *, dealloc_func>> &currentFreeList =
+                currentMemoryInformation.mFreeLists[localEpoch];
+            currentFreeList.emplace_back(func_pair);
+            currentMemoryInformation.mThreadWantsToAdvance = (currentFreeList.size() % 64u) == 0;
+            mBacklog.fetch_add(1, std::memory_order_relaxed);
         }
 
-        void scheduleForDeletion(std::pair<void *, dealloc_func> func_pair) {
-            mThreadSpecificInformations.local().scheduleForDeletion(func_pair);
+        // deletions scheduled but not run yet, across all threads
+        long long getBacklog() const {
+            return mBacklog.load(std::memory_order_relaxed);
+        }
+
+        long long getFreed() const {
+            return mFreed.load(std::memory_order_relaxed);
+        }
+
+    private:
+        // run or hand over the deletions of a free list that became safe
+        void reclaim(std::vector<std::pair<void *, dealloc_func>> &freeList) {
+            if (freeList.empty()) {
+                return;
+            }
+            if (!mReclaimer.joinable()) {
+                runDeletions(freeList);
+                return;
+            }
+            mReclaimLock.lock();
+            mReclaimQueue.insert(mReclaimQueue.end(), freeList.begin(), freeList.end());
+            mReclaimLock.unlock();
+            freeList.resize(0u);
+        }
+
+        void runDeletions(std::vector<std::pair<void *, dealloc_func>> &freeList) {
+            for (std::pair<void *, dealloc_func> func_pair : freeList) {
+                func_pair.second(func_pair.first);
+            }
+            mBacklog.fetch_sub(freeList.size(), std::memory_order_relaxed);
+            mFreed.fetch_add(freeList.size(), std::memory_order_relaxed);
+            freeList.resize(0u);
+        }
+
+        // keeps the epoch moving while there is garbage, and runs what became safe
+        void reclaimerLoop() {
+            std::vector<std::pair<void *, dealloc_func>> batch;
+            while (!mStopReclaimer.load()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                if (getBacklog() > 0) {
+                    tryAdvance(mCurrentEpoch.load());
+                }
+                mReclaimLock.lock();
+                batch.swap(mReclaimQueue);
+                mReclaimLock.unlock();
+                runDeletions(batch);
+            }
         }
     };
 
     class EpochGuard {
         EpochBasedMemoryReclamationStrategy *instance;
+        ThreadSpecificEpochBasedReclamationInformation &information;
 
     public:
-        EpochGuard() {
-            instance = EpochBasedMemoryReclamationStrategy::getInstance();
-            instance->enterCriticalSection();
-        }
+        explicit EpochGuard(EpochBasedMemoryReclamationStrategy *instance)
+            : instance(instance), information(instance->enterCriticalSection()) {}
 
-        ~EpochGuard() { instance->leaveCriticialSection(); }
+        ~EpochGuard() { instance->leaveCriticialSection(information); }
+
+        ThreadCounters &counters() const { return information.mCounters; }
     };
 
     EpochBasedMemoryReclamationStrategy *ebr;
     
     typedef std::pair<T, P> V;
 
-    LIPP(double BUILD_LR_REMAIN = 0, bool QUIET = true)
-        : BUILD_LR_REMAIN(BUILD_LR_REMAIN), QUIET(QUIET) {
-        {
-            std::vector<Node*> nodes;
-            for (int _ = 0; _ < 1e7; _ ++) {
-                Node* node = build_tree_two(T(0), P(), T(1), P());
-                nodes.push_back(node);
-            }
-            for (auto node : nodes) {
-                destroy_tree(node);
-            }
-            if (!QUIET) {
-                printf("initial memory pool size = %lu\n", pending_two.size());
-            }
-        }
+    LIPP(double BUILD_LR_REMAIN = 0, bool QUIET = true, int SHADOW_REBUILD_SIZE = 16384, int TWO_POOL_HIGH_WATER = 4096,
+         bool BACKGROUND_RECLAIM = false, int NUMA_INTERLEAVE_LEVELS = 0)
+        : BUILD_LR_REMAIN(BUILD_LR_REMAIN), QUIET(QUIET), SHADOW_REBUILD_SIZE(SHADOW_REBUILD_SIZE),
+          TWO_POOL_HIGH_WATER(std::max(TWO_POOL_HIGH_WATER, TWO_POOL_BATCH)),
+          NUMA_INTERLEAVE_LEVELS(NUMA_INTERLEAVE_LEVELS) {
         if (USE_FMCD && !QUIET) {
             printf("enable FMCD\n");
         }
 
         root = build_tree_none();
-        ebr = EpochBasedMemoryReclamationStrategy::getInstance();
+        ebr = new EpochBasedMemoryReclamationStrategy(BACKGROUND_RECLAIM);
     }
     ~LIPP() {
+        wait_rebuilds();
         destroy_tree(root);
         root = NULL;
         destory_pending();
+        delete ebr;
+        for (const auto& snapshot : snapshots) {
+            munmap(snapshot.first, snapshot.second);
+        }
+    }
+
+    // Inserts key if it is not present yet; otherwise leaves the stored value
+    // alone and returns false.
+    bool insert(const V& v) {
+        return insert(v.first, v.second);
+    }
+    bool insert(const T& key, const P& value) {
+        EpochGuard guard(ebr); // epoch memory reclaimation
+        return !insert_tree(key, value, INSERT_ONLY);
     }
+    // Inserts the pairs of vs, sorted by strictly increasing key, whose keys are not
+    // present yet and returns how many were inserted. The batch is split by predicted
+    // slot at every level and descends once per part: the keys a part brings to a
+    // node are written under one lock, with one counter update for the path. A part
+    // that is large compared to its subtree is merged into a rebuilt copy of it.
+    int insert_batch(const V* vs, int n) {
+        for (int i = 1; i < n; i ++) {
+            RT_ASSERT(vs[i].first > vs[i-1].first);
+        }
+        EpochGuard guard(ebr); // epoch memory reclaimation
 
-    void insert(const V& v) {
-        insert(v.first, v.second);
+        constexpr int MAX_DEPTH = 128;
+        Node* path[MAX_DEPTH];
+        BatchScratch scratch;
+        if (n > 0) {
+            scratch.retry.push_back({0, n});
+        }
+        int inserted = 0;
+        int restarts = -1;
+        while (!scratch.retry.empty()) {
+            const std::pair<int, int> part = scratch.retry.back(); scratch.retry.pop_back();
+            restarts ++;
+            if (restarts > 0) {
+                yield(restarts); // back off, the writer in the way may have been preempted
+            }
+            bool needRestart = false;
+            Node* node = root;
+            uint64_t version = node->lock.readLockOrRestart(needRestart);
+            if (needRestart) {
+                scratch.retry.push_back(part);
+                continue;
+            }
+            inserted += insert_batch_tree(path, 0, node, version, vs, part.first, part.second, scratch);
+        }
+        if (restarts > 0) {
+            local_counters().olc_restarts.add(restarts);
+        }
+        return inserted;
+    }
+    // Overwrites the value of an existing key in place, without touching the
+    // sizes or rebuild counters. Returns false if key is not present.
+    bool update(const T& key, const P& value) {
+        EpochGuard guard(ebr); // epoch memory reclaimation
+        return insert_tree(key, value, UPDATE_ONLY);
     }
-    void insert(const T& key, const P& value) {
-        EpochGuard guard; // epoch memory reclaimation
-        root = insert_tree(root, key, value);
+    // Inserts key, or overwrites its value in place if it is already present.
+    // Returns true if key was newly inserted.
+    bool insert_or_assign(const T& key, const P& value) {
+        EpochGuard guard(ebr); // epoch memory reclaimation
+        return !insert_tree(key, value, INSERT_OR_ASSIGN);
     }
+    // Removes key, returns false if it was not present. Emptied child nodes are
+    // unlinked from their parents, and a subtree that shrank far below its
+    // build size is rebuilt compactly.
+    bool erase(const T& key) {
+        EpochGuard guard(ebr); // epoch memory reclaimation
+        return erase_tree(key);
+    }
+    // Readers never take locks: every node is read under its version number,
+    // which is validated before following a child pointer or returning a value.
+    // A conflicting writer forces a restart from the root.
     P at(const T& key, bool skip_existence_check = true) const {
-        EpochGuard guard; // epoch memory reclaimation
-        Node* node = root;
+        EpochGuard guard(ebr); // epoch memory reclaimation
 
-        while (true) {
-            int pos = PREDICT_POS(node, key);
-            if (BITMAP_GET(node->child_bitmap, pos) == 1) {
-                node = node->items[pos].comp.child;
-            } else {
-                if (skip_existence_check) {
-                    return node->items[pos].comp.data.value;
+        for (int restarts = 0; ; restarts ++) {
+            if (restarts > 0) {
+                yield(restarts); // back off, the writer in the way may have been preempted
+            }
+            bool needRestart = false;
+            Node* node = root;
+            uint64_t version = node->lock.readLockOrRestart(needRestart);
+            if (needRestart) continue;
+
+            for (int depth = 1; ; depth ++) {
+                int pos = PREDICT_POS(node, key);
+                if (BITMAP_GET(CHILD_BITMAP(node), pos) == 1) {
+                    Node* child = node->items[pos].comp.child;
+                    node->lock.checkOrRestart(version, needRestart);
+                    if (needRestart) break;
+                    version = child->lock.readLockOrRestart(needRestart);
+                    if (needRestart) break;
+                    node = child;
+                } else {
+                    const bool is_none = BITMAP_GET(NONE_BITMAP(node), pos) == 1;
+                    const T found_key = node->items[pos].comp.data.key;
+                    const P value = node->items[pos].comp.data.value;
+                    node->lock.checkOrRestart(version, needRestart);
+                    if (needRestart) break;
+                    if (!skip_existence_check) {
+                        RT_ASSERT(!is_none);
+                        RT_ASSERT(found_key == key);
+                    }
+                    count_lookups(guard.counters(), 1, depth, restarts);
+                    return value;
+                }
+            }
+        }
+    }
+    // Batched lookup of n keys, out[i] receives the value of keys[i]. Up to
+    // MULTI_AT_GROUP lookups are kept in flight in AMAC style: each step of a
+    // lookup prefetches what its next step needs and yields to the others, so the
+    // misses on one lookup's bitmap, item and child node overlap with the rest.
+    void multi_at(const T* keys, P* out, size_t n) const {
+        EpochGuard guard(ebr); // epoch memory reclaimation
+
+        constexpr int MULTI_AT_GROUP = 16;
+        struct {
+            size_t idx; // index into keys, n when the slot is idle
+            Node* node;
+            uint64_t version;
+            int pos;
+            bool at_item; // false: node is being fetched, true: its item is being fetched
+        } lookups[MULTI_AT_GROUP];
+
+        size_t next = 0;
+        int active = 0;
+        long long depth = 0, restarts = 0;
+        for (int g = 0; g < MULTI_AT_GROUP; g ++) {
+            lookups[g].idx = next < n ? next ++ : n;
+            lookups[g].node = root;
+            lookups[g].at_item = false;
+            active += lookups[g].idx < n;
+        }
+
+        while (active > 0) {
+            for (int g = 0; g < MULTI_AT_GROUP; g ++) {
+                auto& l = lookups[g];
+                if (l.idx == n) continue;
+
+                bool needRestart = false;
+                if (!l.at_item) {
+                    l.version = l.node->lock.readLockOrRestart(needRestart);
+                    if (needRestart) {
+                        l.node = root;
+                        restarts ++;
+                        continue;
+                    }
+                    depth ++;
+                    l.pos = PREDICT_POS(l.node, keys[l.idx]);
+                    __builtin_prefetch(&BITMAP_WORD(CHILD_BITMAP(l.node), l.pos));
+                    __builtin_prefetch(&l.node->items[l.pos]);
+                    l.at_item = true;
+                } else if (BITMAP_GET(CHILD_BITMAP(l.node), l.pos) == 1) {
+                    Node* child = l.node->items[l.pos].comp.child;
+                    l.node->lock.checkOrRestart(l.version, needRestart);
+                    l.at_item = false;
+                    if (needRestart) {
+                        l.node = root;
+                        restarts ++;
+                        continue;
+                    }
+                    __builtin_prefetch(child);
+                    __builtin_prefetch(reinterpret_cast<const char*>(child) + 64);
+                    l.node = child;
                 } else {
-                    if (BITMAP_GET(node->none_bitmap, pos) == 1) {
-                        RT_ASSERT(false);
-                    } else if (BITMAP_GET(node->child_bitmap, pos) == 0) {
-                        RT_ASSERT(node->items[pos].comp.data.key == key);
-                        return node->items[pos].comp.data.value;
+                    const P value = l.node->items[l.pos].comp.data.value;
+                    l.node->lock.checkOrRestart(l.version, needRestart);
+                    l.at_item = false;
+                    if (needRestart) {
+                        l.node = root;
+                        restarts ++;
+                        continue;
+                    }
+                    out[l.idx] = value;
+                    if (next < n) {
+                        l.idx = next ++;
+                        l.node = root;
+                    } else {
+                        l.idx = n;
+                        active --;
                     }
                 }
             }
         }
+        count_lookups(guard.counters(), n, depth, restarts);
     }
     bool exists(const T& key) const {
-        EpochGuard guard; // epoch memory reclaimation
-        Node* node = root;
-        while (true) {
-            int pos = PREDICT_POS(node, key);
-            if (BITMAP_GET(node->none_bitmap, pos) == 1) {
-                return false;
-            } else if (BITMAP_GET(node->child_bitmap, pos) == 0) {
-                return node->items[pos].comp.data.key == key;
-            } else {
-                node = node->items[pos].comp.child;
+        EpochGuard guard(ebr); // epoch memory reclaimation
+
+        for (int restarts = 0; ; restarts ++) {
+            if (restarts > 0) {
+                yield(restarts); // back off, the writer in the way may have been preempted
+            }
+            bool needRestart = false;
+            Node* node = root;
+            uint64_t version = node->lock.readLockOrRestart(needRestart);
+            if (needRestart) continue;
+
+            for (int depth = 1; ; depth ++) {
+                int pos = PREDICT_POS(node, key);
+                if (BITMAP_GET(CHILD_BITMAP(node), pos) == 1) {
+                    Node* child = node->items[pos].comp.child;
+                    node->lock.checkOrRestart(version, needRestart);
+                    if (needRestart) break;
+                    version = child->lock.readLockOrRestart(needRestart);
+                    if (needRestart) break;
+                    node = child;
+                } else {
+                    const bool found = BITMAP_GET(NONE_BITMAP(node), pos) == 0 &&
+                                       node->items[pos].comp.data.key == key;
+                    node->lock.checkOrRestart(version, needRestart);
+                    if (needRestart) break;
+                    count_lookups(guard.counters(), 1, depth, restarts);
+                    return found;
+                }
+            }
+        }
+    }
+    // Copies up to n pairs with key >= lo into out in ascending key order and
+    // returns how many were copied. Slots are read one at a time under the
+    // node's version, so the scan never blocks writers: keys inserted while it
+    // runs may or may not be seen, but every pair returned was in the index.
+    int range_scan(const T& lo, int n, V* out) const {
+        EpochGuard guard(ebr); // epoch memory reclaimation
+
+        constexpr int MAX_DEPTH = 128;
+        struct {
+            Node* node;
+            int pos; // next slot to visit
+            bool bounded; // the next slot is on the path of lo and may hold smaller keys
+        } s[MAX_DEPTH];
+        int depth = 0;
+        int count = 0;
+
+        Node* _root = root;
+        s[depth ++] = {_root, PREDICT_POS(_root, lo), true};
+        while (depth > 0 && count < n) {
+            auto& f = s[depth - 1];
+
+            int pos = 0;
+            bool is_child = false;
+            Node* child = NULL;
+            T key = T();
+            P value = P();
+            for (int spins = 0; ; spins ++) {
+                uint64_t version = f.node->lock.get_version_number();
+                if (f.node->lock.isLocked(version)) {
+                    yield(spins);
+                    continue;
+                }
+                pos = next_occupied(f.node, f.pos);
+                if (pos < f.node->num_items) {
+                    is_child = BITMAP_GET(CHILD_BITMAP(f.node), pos) == 1;
+                    if (is_child) {
+                        child = f.node->items[pos].comp.child;
+                    } else {
+                        key = f.node->items[pos].comp.data.key;
+                        value = f.node->items[pos].comp.data.value;
+                    }
+                }
+                if (f.node->lock.get_version_number() == version) {
+                    break;
+                }
+            }
+
+            if (pos >= f.node->num_items) {
+                depth --;
+                continue;
+            }
+            const bool bounded = f.bounded && pos == f.pos;
+            f.pos = pos + 1;
+            f.bounded = false;
+            if (is_child) {
+                RT_ASSERT(depth < MAX_DEPTH);
+                s[depth ++] = {child, bounded ? PREDICT_POS(child, lo) : 0, bounded};
+            } else if (!bounded || key >= lo) {
+                out[count ++] = V(key, value);
             }
         }
+        return count;
+    }
+    // Smallest pair with key >= the given key; returns false if there is none.
+    bool lower_bound(const T& key, V& result) const {
+        return range_scan(key, 1, &result) == 1;
     }
     void bulk_load(const V* vs, int num_keys) {
+        T* keys = new T[num_keys];
+        P* values = new P[num_keys];
+        tbb::parallel_for(tbb::blocked_range<int>(0, num_keys, PARALLEL_BUILD_SIZE), [&](const tbb::blocked_range<int>& r) {
+            for (int i = r.begin(); i < r.end(); i ++) {
+                keys[i] = vs[i].first;
+                values[i] = vs[i].second;
+            }
+        });
+        bulk_load(keys, values, num_keys);
+        delete[] keys;
+        delete[] values;
+    }
+    // Same as above from separate arrays, keys sorted in asc order. Both arrays are
+    // only read, so they can come straight from e.g. a memory mapped file.
+    void bulk_load(const T* keys, const P* values, int num_keys) {
+        wait_rebuilds();
         if (num_keys == 0) {
             destroy_tree(root);
             root = build_tree_none();
@@ -299,30 +693,171 @@ public:
         if (num_keys == 1) {
             destroy_tree(root);
             root = build_tree_none();
-            insert(vs[0]);
+            insert(keys[0], values[0]);
             return;
         }
         if (num_keys == 2) {
             destroy_tree(root);
-            root = build_tree_two(vs[0].first, vs[0].second, vs[1].first, vs[1].second);
+            root = build_tree_two(keys[0], values[0], keys[1], values[1]);
             return;
         }
 
         RT_ASSERT(num_keys > 2);
-        for (int i = 1; i < num_keys; i ++) {
-            RT_ASSERT(vs[i].first > vs[i-1].first);
+        tbb::parallel_for(tbb::blocked_range<int>(1, num_keys, PARALLEL_BUILD_SIZE), [&](const tbb::blocked_range<int>& r) {
+            for (int i = r.begin(); i < r.end(); i ++) {
+                RT_ASSERT(keys[i] > keys[i-1]);
+            }
+        });
+        destroy_tree(root);
+        root = build_tree_bulk(keys, values, num_keys);
+        interleave_top_levels(root, 0);
+    }
+    // Writes the tree to path as a snapshot for open(). Nodes are stored in breadth
+    // first order, root first, with their bitmaps, items and child pointers as offsets
+    // from the start of the file; the header records the number of keys and a hash of
+    // the whole key set, both taken by the same walk. The file is written next to path and renamed
+    // over it, so an index that opened the file at path keeps its mapping. Must not run
+    // concurrently with writers, shadow rebuilds still queued are waited for. Returns
+    // false if the file could not be written.
+    bool save(const char* path) const {
+        static_assert(std::is_trivially_copyable<P>::value, "a snapshot stores values as raw bytes");
+        wait_rebuilds();
+
+        std::vector<Node*> order(1, root);
+        uint64_t num_keys = 0;
+        uint64_t key_set_hash = 0;
+        for (size_t i = 0; i < order.size(); i ++) {
+            Node* node = order[i];
+            for (int pos = 0; pos < node->num_items; pos ++) {
+                if (BITMAP_GET(NONE_BITMAP(node), pos) == 1) {
+                    continue;
+                }
+                if (BITMAP_GET(CHILD_BITMAP(node), pos) == 1) {
+                    order.push_back(node->items[pos].comp.child);
+                } else {
+                    num_keys ++;
+                    key_set_hash += snapshot_key_hash(node->items[pos].comp.data.key);
+                }
+            }
+        }
+        SnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = SNAPSHOT_MAGIC;
+        header.key_size = sizeof(T);
+        header.value_size = sizeof(P);
+        header.node_size = sizeof(Node);
+        header.fast_model = USE_FAST_MODEL;
+        header.num_nodes = order.size();
+        header.num_keys = num_keys;
+        header.key_set_hash = key_set_hash;
+        header.nodes_offset = snapshot_align(sizeof(SnapshotHeader));
+        std::vector<uint64_t> slot_offsets(order.size());
+        uint64_t offset = header.nodes_offset + sizeof(Node) * order.size();
+        for (size_t i = 0; i < order.size(); i ++) {
+            slot_offsets[i] = offset = snapshot_align(offset);
+            offset += slots_bytes(order[i]->num_items);
         }
+        header.file_size = offset;
 
-        T* keys = new T[num_keys];
-        P* values = new P[num_keys];
-        for (int i = 0; i < num_keys; i ++) {
-            keys[i] = vs[i].first;
-            values[i] = vs[i].second;
+        const std::string tmp_path = std::string(path) + ".tmp";
+        FILE* file = fopen(tmp_path.c_str(), "wb");
+        if (file == NULL) {
+            return false;
+        }
+        std::vector<char> buffer(header.nodes_offset, 0);
+        memcpy(buffer.data(), &header, sizeof(header));
+        bool ok = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+        for (size_t i = 0; ok && i < order.size(); i ++) {
+            alignas(Node) char copy[sizeof(Node)];
+            memcpy(copy, order[i], sizeof(Node));
+            Node* node = reinterpret_cast<Node*>(copy);
+            new (&node->lock) OptLock();
+            node->bitmaps = reinterpret_cast<bitmap_t*>(slot_offsets[i]);
+            node->items = reinterpret_cast<Item*>(slot_offsets[i] + (reinterpret_cast<char*>(order[i]->items) -
+                                                                      reinterpret_cast<char*>(order[i]->bitmaps)));
+            node->in_snapshot = true;
+            node->rebuild_log = NULL;
+            node->rebuild_pending = false;
+            ok = fwrite(copy, sizeof(Node), 1, file) == 1;
+        }
+        buffer.assign(slot_offsets[0] - header.nodes_offset - sizeof(Node) * order.size(), 0);
+        ok = ok && fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+        // children are numbered in the order the traversal above met them
+        size_t next = 1;
+        for (size_t i = 0; ok && i < order.size(); i ++) {
+            Node* node = order[i];
+            const size_t end = i + 1 < order.size() ? slot_offsets[i + 1] : header.file_size;
+            buffer.assign(end - slot_offsets[i], 0);
+            memcpy(buffer.data(), node->bitmaps, slots_bytes(node->num_items));
+            Item* items = reinterpret_cast<Item*>(buffer.data() + (reinterpret_cast<char*>(node->items) -
+                                                                   reinterpret_cast<char*>(node->bitmaps)));
+            for (int pos = next_child(node, 0); pos < node->num_items; pos = next_child(node, pos + 1)) {
+                items[pos].comp.child = reinterpret_cast<Node*>(header.nodes_offset + sizeof(Node) * next ++);
+            }
+            ok = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+        }
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmp_path.c_str(), path) != 0) {
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+    // Replaces the tree by the snapshot at path without building anything: the file is
+    // mapped privately, one parallel pass turns the offsets of the node headers and
+    // child slots back into pointers, and all other pages are faulted in by the
+    // operations that need them. Writes to snapshot nodes are copied on write by the
+    // kernel, nodes built later come from Alloc as usual, and snapshot nodes that get
+    // replaced are not freed, the mapping lives as long as the index. Like bulk_load()
+    // it must not run concurrently with other operations. Returns false if path is not
+    // a snapshot of an index of this type, or, when the keys it is expected to hold are
+    // given, if its key count or key set hash differ from theirs.
+    bool open(const char* path, const T* expected_keys = NULL, size_t num_expected = 0) {
+        wait_rebuilds();
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(SnapshotHeader))) {
+            ::close(fd);
+            return false;
+        }
+        const size_t file_size = st.st_size;
+        char* base = static_cast<char*>(mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0));
+        ::close(fd);
+        if (base == MAP_FAILED) {
+            return false;
+        }
+        const SnapshotHeader& header = *reinterpret_cast<SnapshotHeader*>(base);
+        if (header.magic != SNAPSHOT_MAGIC || header.key_size != sizeof(T) || header.value_size != sizeof(P) ||
+            header.node_size != sizeof(Node) || header.fast_model != USE_FAST_MODEL ||
+            header.file_size != file_size || header.num_nodes == 0) {
+            munmap(base, file_size);
+            return false;
+        }
+        if (expected_keys != NULL &&
+            (header.num_keys != num_expected || header.key_set_hash != key_set_hash(expected_keys, num_expected))) {
+            munmap(base, file_size);
+            return false;
         }
+
+        Node* nodes = reinterpret_cast<Node*>(base + header.nodes_offset);
+        tbb::parallel_for(tbb::blocked_range<uint64_t>(0, header.num_nodes, 4096), [&](const tbb::blocked_range<uint64_t>& r) {
+            for (uint64_t i = r.begin(); i < r.end(); i ++) {
+                Node* node = &nodes[i];
+                node->bitmaps = reinterpret_cast<bitmap_t*>(base + reinterpret_cast<uintptr_t>(node->bitmaps));
+                node->items = reinterpret_cast<Item*>(base + reinterpret_cast<uintptr_t>(node->items));
+                for (int pos = next_child(node, 0); pos < node->num_items; pos = next_child(node, pos + 1)) {
+                    node->items[pos].comp.child = reinterpret_cast<Node*>(base + reinterpret_cast<uintptr_t>(node->items[pos].comp.child));
+                }
+            }
+        });
         destroy_tree(root);
-        root = build_tree_bulk(keys, values, num_keys);
-        delete[] keys;
-        delete[] values;
+        root = nodes;
+        snapshots.push_back({base, file_size});
+        interleave_top_levels(root, 0);
+        return true;
     }
 
     void show() const {
@@ -341,9 +876,9 @@ public:
                     printf(", ");
                 }
                 first = 0;
-                if (BITMAP_GET(node->none_bitmap, i) == 1) {
+                if (BITMAP_GET(NONE_BITMAP(node), i) == 1) {
                     printf("None");
-                } else if (BITMAP_GET(node->child_bitmap, i) == 0) {
+                } else if (BITMAP_GET(CHILD_BITMAP(node), i) == 0) {
                     std::stringstream s;
                     s << node->items[i].comp.data.key;
                     printf("Key(%s)", s.str().c_str());
@@ -366,49 +901,148 @@ public:
         while (!s.empty()) {
             Node* node = s.top(); s.pop();
             int depth = d.top(); d.pop();
-            for (int i = 0; i < node->num_items; i ++) {
-                if (BITMAP_GET(node->child_bitmap, i) == 1) {
-                    s.push(node->items[i].comp.child);
-                    d.push(depth + 1);
-                } else if (BITMAP_GET(node->none_bitmap, i) != 1) {
-                    max_depth = std::max(max_depth, depth);
-                    sum_depth += depth;
-                    sum_nodes ++;
-                }
+            for (int i = next_child(node, 0); i < node->num_items; i = next_child(node, i + 1)) {
+                s.push(node->items[i].comp.child);
+                d.push(depth + 1);
+            }
+            const int num_data = count_data(node);
+            if (num_data > 0) {
+                max_depth = std::max(max_depth, depth);
+                sum_depth += depth * num_data;
+                sum_nodes += num_data;
             }
         }
 
         printf("max_depth = %d, avg_depth = %.2lf\n", max_depth, double(sum_depth) / double(sum_nodes));
     }
-    void verify() const {
+    /// memory layout of the tree; lines_per_lookup is the average number of distinct
+    /// cache lines of bitmaps and items an at() touches, node headers not included
+    void print_layout() const {
         std::stack<Node*> s;
         s.push(root);
 
+        long long num_nodes = 0, num_slots = 0, num_data = 0, num_child = 0;
+        size_t header_bytes = 0, slot_bytes = 0;
+        double sum_lines = 0;
         while (!s.empty()) {
             Node* node = s.top(); s.pop();
-            int sum_size = 0;
-            for (int i = 0; i < node->num_items; i ++) {
-                if (BITMAP_GET(node->child_bitmap, i) == 1) {
+            num_nodes ++;
+            num_slots += node->num_items;
+            num_data += count_data(node);
+            header_bytes += sizeof(Node);
+            slot_bytes += slots_bytes(node->num_items);
+            for (int i = next_occupied(node, 0); i < node->num_items; i = next_occupied(node, i + 1)) {
+                const uintptr_t word_line = reinterpret_cast<uintptr_t>(&BITMAP_WORD(CHILD_BITMAP(node), i)) / 64;
+                const uintptr_t item_line = reinterpret_cast<uintptr_t>(&node->items[i]) / 64;
+                const int lines = word_line == item_line ? 1 : 2;
+                if (BITMAP_GET(CHILD_BITMAP(node), i) == 1) {
+                    num_child ++;
                     s.push(node->items[i].comp.child);
-                    sum_size += node->items[i].comp.child->size;
-                } else if (BITMAP_GET(node->none_bitmap, i) != 1) {
-                    sum_size ++;
+                    sum_lines += double(lines) * node->items[i].comp.child->size;
+                } else {
+                    sum_lines += lines;
                 }
             }
+        }
+
+        printf("nodes = %lld, slots = %lld (data %.2lf%%, child %.2lf%%), header_bytes = %zu, slot_bytes = %zu, lines_per_lookup = %.2lf\n",
+               num_nodes, num_slots, 100.0 * num_data / num_slots, 100.0 * num_child / num_slots,
+               header_bytes, slot_bytes, sum_lines / std::max(1, root.load()->size.load()));
+    }
+    // Checks the size of every node against its contents, RT_ASSERT on a mismatch.
+    // Must not run concurrently with writers, shadow rebuilds still queued are waited
+    // for.
+    void verify() const {
+        wait_rebuilds();
+        std::stack<Node*> s;
+        s.push(root);
+
+        while (!s.empty()) {
+            Node* node = s.top(); s.pop();
+            int sum_size = count_data(node);
+            for (int i = next_child(node, 0); i < node->num_items; i = next_child(node, i + 1)) {
+                s.push(node->items[i].comp.child);
+                sum_size += node->items[i].comp.child->size;
+            }
             RT_ASSERT(sum_size == node->size);
         }
     }
     void print_stats() const {
+        const Metrics metrics = get_metrics();
         printf("======== Stats ===========\n");
         if (USE_FMCD) {
-            printf("\t fmcd_success_times = %lld\n", stats.fmcd_success_times);
-            printf("\t fmcd_broken_times = %lld\n", stats.fmcd_broken_times);
+            printf("\t fmcd_success_times = %lld\n", metrics.fmcd_success_times);
+            printf("\t fmcd_broken_times = %lld\n", metrics.fmcd_broken_times);
+        }
+        if (USE_FAST_MODEL) {
+            printf("\t fast_model_rejected_times = %lld\n", metrics.fast_model_rejected_times);
         }
+        printf("\t lookups = %lld, avg_lookup_depth = %.2lf, olc_restarts = %lld\n", metrics.lookups,
+               metrics.lookups == 0 ? 0.0 : double(metrics.lookup_depth) / metrics.lookups, metrics.olc_restarts);
+        printf("\t rebuilds =");
+        for (int level = 0; level < METRIC_LEVELS; level ++) {
+            printf(" %lld", metrics.rebuilds[level]);
+        }
+        printf(" (by level), rebuild_keys = %lld, rebuild_bytes = %lld\n", metrics.rebuild_keys, metrics.rebuild_bytes);
+        printf("\t two_node_creations = %lld\n", metrics.two_node_creations);
+        printf("\t ebr_frees = %lld, garbage_backlog = %lld\n", metrics.ebr_frees, metrics.garbage_backlog);
         #if COLLECT_TIME
         printf("\t time_scan_and_destory_tree = %lf\n", stats.time_scan_and_destory_tree);
         printf("\t time_build_tree_bulk = %lf\n", stats.time_build_tree_bulk);
         #endif
     }
+    struct Metrics {
+        long long lookups; // at(), exists() and multi_at() keys
+        long long lookup_depth; // nodes they visited, including the leaf
+        long long olc_restarts; // traversals restarted after a version check failed
+        long long rebuilds[METRIC_LEVELS]; // subtrees rebuilt, by the depth of their root
+        long long rebuild_keys; // keys moved into the rebuilt subtrees
+        long long rebuild_bytes; // bytes of node memory allocated for them
+        long long two_node_creations; // two-key nodes built, mostly by inserts that hit a data slot
+        long long fmcd_success_times;
+        long long fmcd_broken_times;
+        long long fast_model_rejected_times;
+        long long ebr_frees; // deleters the epoch based reclamation has run
+        long long garbage_backlog; // and the ones still waiting
+
+        long long rebuild_times() const {
+            long long times = 0;
+            for (int level = 0; level < METRIC_LEVELS; level ++) {
+                times += rebuilds[level];
+            }
+            return times;
+        }
+    };
+    /// running totals since construction, the per-thread counters are merged on each
+    /// call, so it may be scraped while other threads use the index. it walks the list
+    /// of registered threads, which only grows at its front, and not the thread specific
+    /// storage, which may not be iterated while a thread creates its element
+    Metrics get_metrics() const {
+        Metrics metrics = {};
+        for (const ThreadSpecificEpochBasedReclamationInformation* information = ebr->mRegisteredThreads.load();
+             information != NULL; information = information->mNextRegistered) {
+            const ThreadCounters& c = information->mCounters;
+            metrics.lookups += c.lookups.get();
+            metrics.lookup_depth += c.lookup_depth.get();
+            metrics.olc_restarts += c.olc_restarts.get();
+            for (int level = 0; level < METRIC_LEVELS; level ++) {
+                metrics.rebuilds[level] += c.rebuilds[level].get();
+            }
+            metrics.rebuild_keys += c.rebuild_keys.get();
+            metrics.rebuild_bytes += c.rebuild_bytes.get();
+            metrics.two_node_creations += c.two_node_creations.get();
+            metrics.fmcd_success_times += c.fmcd_success_times.get();
+            metrics.fmcd_broken_times += c.fmcd_broken_times.get();
+            metrics.fast_model_rejected_times += c.fast_model_rejected_times.get();
+        }
+        metrics.ebr_frees = ebr->getFreed();
+        metrics.garbage_backlog = ebr->getBacklog();
+        return metrics;
+    }
+    /// nodes and node lists unlinked from the tree whose deleters have not run yet
+    long long garbage_backlog() const {
+        return ebr->getBacklog();
+    }
     size_t index_size(bool total=false, bool ignore_child=true) const {
         std::stack<Node*> s;
         s.push(root);
@@ -427,7 +1061,7 @@ public:
                 } else {
                     if (total) size += sizeof(Item);
                 }
-                if (BITMAP_GET(node->child_bitmap, i) == 1) {
+                if (BITMAP_GET(CHILD_BITMAP(node), i) == 1) {
                     if (!total) size += sizeof(Item);
                     s.push(node->items[i].comp.child);
                 }
@@ -440,7 +1074,51 @@ public:
     }
 
 private:
+    enum WriteMode {
+        INSERT_ONLY = 0, INSERT_OR_ASSIGN, UPDATE_ONLY
+    };
+
     struct Node;
+    /// a write that landed in a subtree while its shadow copy was being built
+    struct LogEntry
+    {
+        T key;
+        P value;
+        bool erase;
+    };
+    /// keys [begin, end) of an insert_batch() that route through the slot pos of a node
+    struct BatchPart
+    {
+        int begin;
+        int end;
+        int pos;
+        Node* child; // the child the keys descend to, or the new subtree of the slot
+        bool to_child;
+    };
+    /// buffers of one insert_batch(), shared by all levels of its descent
+    struct BatchScratch
+    {
+        std::vector<std::pair<int, int>> retry; // parts that descend from the root again after a conflict
+        std::vector<BatchPart> parts; // of the nodes on the current path, top-down
+        std::vector<LogEntry> entries;
+        std::vector<T> keys;
+        std::vector<P> values;
+    };
+    /// keys [begin, end) of a bulk build that go to node
+    struct Segment
+    {
+        int begin;
+        int end;
+        int level; // top level = 1
+        Node* node;
+    };
+    /// writes that land in a subtree while its shadow copy is being built
+    struct RebuildLog
+    {
+        spin_lock lock;
+        bool closed = false; // set right before the swap, writers must retry against the new subtree
+        std::vector<LogEntry> entries;
+    };
     struct Item
     {
         union {
@@ -451,107 +1129,333 @@ private:
             Node* child;
         } comp;
     };
-    struct Node
+    struct alignas(64) Node
     {
+        // what a lookup reads comes first, up to the double part of model it fits the first
+        // cache line. the counters every insert below the node bumps are on the second one,
+        // so the root line all lookups predict with is not written by each insert.
+        OptLock lock; // guards items and bitmaps; counters are updated atomically
+        int num_items; // size of items
         int is_two; // is special node for only two keys
+        // one block holding the interleaved bitmaps and then the items, see NONE_BITMAP.
+        // none bit 1 means None, 0 means Data or Child; child bit 1 means Child, always 0 when none is 1
+        bitmap_t* bitmaps;
+        Item* items; // points into the block of bitmaps
+        LinearModel<T> model;
+        std::atomic<int> size; // current tree size (include sub nodes)
+        std::atomic<int> num_inserts, num_insert_to_data;
         int build_size; // tree size (include sub nodes) when node created
-        int size; // current tree size (include sub nodes)
         int fixed; // fixed node will not trigger rebuild
-        int num_inserts, num_insert_to_data;
-        int num_items; // size of items
-        LinearModel<T> model;
-        Item* items;
-        bitmap_t* none_bitmap; // 1 means None, 0 means Data or Child
-        bitmap_t* child_bitmap; // 1 means Child. will always be 0 when none_bitmap is 1
+        bool in_snapshot = false; // node and slots live in a mapping of open() and are never freed
+        std::atomic<RebuildLog*> rebuild_log; // non-NULL while a shadow rebuild of this subtree runs
+        std::atomic<bool> rebuild_pending; // a shadow rebuild of this subtree is queued
     };
 
-    Node* root;
-    std::stack<Node*> pending_two;
+    std::atomic<Node*> root;
+    std::vector<std::pair<void*, size_t>> snapshots; // mappings of open(), unmapped by the destructor
+    // shadow rebuilds run as tasks of this arena, not on the insert or erase that found them due
+    tbb::task_arena rebuild_arena;
+    std::atomic<int> queued_rebuilds{0};
+
+    static constexpr uint64_t SNAPSHOT_MAGIC = 0x33504e535050494cULL; // "LIPPSNP3"
+    /// at the start of a snapshot file, followed by the nodes and then their slots
+    struct SnapshotHeader
+    {
+        uint64_t magic;
+        uint32_t key_size; // the layout of the index type that wrote it
+        uint32_t value_size;
+        uint32_t node_size;
+        uint32_t fast_model;
+        uint64_t num_nodes;
+        uint64_t num_keys; // with key_set_hash, tells the key set it was saved from
+        uint64_t key_set_hash;
+        uint64_t nodes_offset;
+        uint64_t file_size;
+    };
+    /// nodes and slot blocks of a snapshot start on cache lines
+    static uint64_t snapshot_align(uint64_t offset)
+    {
+        return (offset + 63) / 64 * 64;
+    }
+    /// std::hash of a key through the splitmix64 finalizer. The hash of a key set is the
+    /// sum of these, so it does not depend on the order the keys are visited in
+    static uint64_t snapshot_key_hash(const T& key)
+    {
+        uint64_t h = std::hash<T>()(key);
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    }
+    /// the hash of the n keys at keys, as save() computes it over the tree
+    static uint64_t key_set_hash(const T* keys, size_t n)
+    {
+        return tbb::parallel_reduce(tbb::blocked_range<size_t>(0, n, PARALLEL_BUILD_SIZE), uint64_t(0),
+            [&](const tbb::blocked_range<size_t>& r, uint64_t hash) {
+                for (size_t i = r.begin(); i < r.end(); i ++) {
+                    hash += snapshot_key_hash(keys[i]);
+                }
+                return hash;
+            }, std::plus<uint64_t>());
+    }
+    // spare two-key nodes of each thread for build_tree_two(). a pool is filled
+    // TWO_POOL_BATCH nodes at a time when it runs dry, and cut back to half of
+    // TWO_POOL_HIGH_WATER when recycled nodes push it above that.
+    static constexpr int TWO_POOL_BATCH = 64;
+    // insert_batch() merges a part of at least this many keys into a rebuilt copy of a
+    // subtree that holds at most four times as many
+    static constexpr int MERGE_BATCH_SIZE = 64;
+    // an insert that reaches this depth does not leave a due shadow rebuild to the queue
+    static constexpr int INLINE_REBUILD_DEPTH = 32;
+    tbb::enumerable_thread_specific<std::vector<Node*>, tbb::cache_aligned_allocator<std::vector<Node*>>,
+                                    tbb::ets_key_per_instance> two_pools;
 
-    std::allocator<Node> node_allocator;
     Node* new_nodes(int n)
     {
-        Node* p = node_allocator.allocate(n);
+        Node* p = static_cast<Node*>(Alloc::allocate(sizeof(Node) * n));
         RT_ASSERT(p != NULL && p != (Node*)(-1));
+        for (int i = 0; i < n; i ++) {
+            new (&p[i]) Node();
+        }
         return p;
     }
     void delete_nodes(Node* p, int n)
     {
-        node_allocator.deallocate(p, n);
+        Alloc::deallocate(p, sizeof(Node) * n);
     }
 
-    std::allocator<Item> item_allocator;
-    Item* new_items(int n)
+    /// call once the model of node is final and before anything is placed with it.
+    /// node predicts with the double model unless that puts two neighbouring keys of
+    /// keys, the sorted keys the node is built from, into one slot where the long double
+    /// model keeps them apart: FMCD's bound on conflicts is computed for the latter.
+    void prepare_model(Node* node, const T* keys, int size)
     {
-        Item* p = item_allocator.allocate(n);
-        RT_ASSERT(p != NULL && p != (Item*)(-1));
-        return p;
+        node->model.fast = false;
+        if (!USE_FAST_MODEL) {
+            return;
+        }
+        node->model.prepare_fast();
+        int prev_fast = -1, prev_precise = -1;
+        for (int i = 0; i < size; i ++) {
+            const int pos_fast = CLAMP_POS(node, node->model.predict_fast(keys[i]));
+            const int pos_precise = CLAMP_POS(node, node->model.predict_double(keys[i]));
+            if (pos_fast == prev_fast && pos_precise != prev_precise) {
+                local_counters().fast_model_rejected_times.add(1);
+                return;
+            }
+            prev_fast = pos_fast;
+            prev_precise = pos_precise;
+        }
+        node->model.fast = true;
     }
-    void delete_items(Item* p, int n)
+
+    /// bytes of the block holding the bitmaps and items of a node
+    static size_t slots_bytes(int num_items)
     {
-        item_allocator.deallocate(p, n);
+        return sizeof(bitmap_t) * 2 * BITMAP_SIZE(num_items) + sizeof(Item) * num_items;
     }
 
-    std::allocator<bitmap_t> bitmap_allocator;
-    bitmap_t* new_bitmap(int n)
+    /// allocate the bitmaps and items of node in one block, every slot starts as None
+    void new_slots(Node* node, int num_items)
     {
-        bitmap_t* p = bitmap_allocator.allocate(n);
-        RT_ASSERT(p != NULL && p != (bitmap_t*)(-1));
-        return p;
+        char* p = static_cast<char*>(Alloc::allocate(slots_bytes(num_items)));
+        RT_ASSERT(p != NULL && p != (char*)(-1));
+        node->num_items = num_items;
+        node->bitmaps = reinterpret_cast<bitmap_t*>(p);
+        node->items = reinterpret_cast<Item*>(p + sizeof(bitmap_t) * 2 * BITMAP_SIZE(num_items));
+        clear_bitmaps(node);
     }
-    void delete_bitmap(bitmap_t* p, int n)
+
+    /// mark every slot of node as None
+    static void clear_bitmaps(Node* node)
     {
-        bitmap_allocator.deallocate(p, n);
+        for (int pos = 0; pos < node->num_items; pos += BITMAP_WIDTH) {
+            BITMAP_WORD(NONE_BITMAP(node), pos) = ~bitmap_t(0);
+            BITMAP_WORD(CHILD_BITMAP(node), pos) = 0;
+        }
     }
 
-    /// build an empty tree
-    Node* build_tree_none()
+    /// bytes of node memory of the subtree rooted at node, which no other thread may modify
+    static size_t subtree_bytes(Node* _node)
     {
-        Node* node = new_nodes(1);
-        node->is_two = 0;
-        node->build_size = 0;
-        node->size = 0;
-        node->fixed = 0;
-        node->num_inserts = node->num_insert_to_data = 0;
-        node->num_items = 1;
-        node->model.a = node->model.b = 0;
-        node->items = new_items(1);
-        node->none_bitmap = new_bitmap(1);
-        node->none_bitmap[0] = 0;
-        BITMAP_SET(node->none_bitmap, 0);
-        node->child_bitmap = new_bitmap(1);
-        node->child_bitmap[0] = 0;
+        size_t bytes = 0;
+        std::stack<Node*> s;
+        s.push(_node);
+        while (!s.empty()) {
+            Node* node = s.top(); s.pop();
+            bytes += sizeof(Node) + slots_bytes(node->num_items);
+            for (int i = next_child(node, 0); i < node->num_items; i = next_child(node, i + 1)) {
+                s.push(node->items[i].comp.child);
+            }
+        }
+        return bytes;
+    }
 
-        return node;
+    /// the counters of the calling thread, registered on first use so that get_metrics()
+    /// sees them. operations under an EpochGuard use guard.counters()
+    ThreadCounters& local_counters() const
+    {
+        return ebr->localInformation().mCounters;
     }
-    /// build a tree with two keys
-    Node* build_tree_two(T key1, P value1, T key2, P value2)
+
+    /// count n lookups that visited depth nodes and restarted restarts times in total
+    static void count_lookups(ThreadCounters& c, long long n, long long depth, long long restarts)
+    {
+        c.lookups.add(n);
+        c.lookup_depth.add(depth);
+        if (restarts > 0) {
+            c.olc_restarts.add(restarts);
+        }
+    }
+
+    /// spread the slots of the nodes of the subtree rooted at _node, which sits at _depth,
+    /// that lie above NUMA_INTERLEAVE_LEVELS over the NUMA nodes. every lookup reads them,
+    /// so no thread should find all of them on a remote node. the levels below are left
+    /// on the nodes of the threads that built them (first touch).
+    void interleave_top_levels(Node* _node, int _depth)
+    {
+        if (_depth >= NUMA_INTERLEAVE_LEVELS || NumaPlacement::num_nodes() < 2) {
+            return;
+        }
+        std::stack<std::pair<Node*, int>> s;
+        s.push({_node, _depth});
+        while (!s.empty()) {
+            Node* node = s.top().first;
+            const int depth = s.top().second;
+            s.pop();
+            NumaPlacement::interleave(node->bitmaps, slots_bytes(node->num_items));
+            if (depth + 1 >= NUMA_INTERLEAVE_LEVELS) {
+                continue;
+            }
+            for (int i = next_child(node, 0); i < node->num_items; i = next_child(node, i + 1)) {
+                s.push({node->items[i].comp.child, depth + 1});
+            }
+        }
+    }
+
+    /// count a rebuild at depth that built a subtree of num_keys keys in bytes of node memory
+    void count_rebuild(int depth, int num_keys, size_t bytes)
+    {
+        ThreadCounters& c = local_counters();
+        c.rebuilds[std::min(depth, METRIC_LEVELS - 1)].add(1);
+        c.rebuild_keys.add(num_keys);
+        c.rebuild_bytes.add(bytes);
+    }
+
+    /// append the blocks owned by node, node itself included, for Alloc::deallocate_bulk().
+    /// a snapshot node owns none, its memory goes with the mapping
+    static void collect_blocks(Node* node, std::vector<AllocBlock>& blocks)
+    {
+        delete node->rebuild_log.load();
+        if (node->in_snapshot) {
+            return;
+        }
+        blocks.push_back({node->bitmaps, slots_bytes(node->num_items)});
+        blocks.push_back({node, sizeof(Node)});
+    }
+
+    /// first slot at or after pos whose bit is 1 in bitmap, or 0 if invert is set;
+    /// num_items if there is none
+    static int next_bit(const bitmap_t* bitmap, bool invert, int num_items, int pos)
+    {
+        if (pos >= num_items) {
+            return num_items;
+        }
+        const bitmap_t flip = invert ? ~bitmap_t(0) : 0;
+        bitmap_t word = (BITMAP_WORD(bitmap, pos) ^ flip) & (~bitmap_t(0) << (pos % BITMAP_WIDTH));
+        pos = pos / BITMAP_WIDTH * BITMAP_WIDTH;
+        while (word == 0) {
+            pos += BITMAP_WIDTH;
+            if (pos >= num_items) {
+                return num_items;
+            }
+            word = BITMAP_WORD(bitmap, pos) ^ flip;
+        }
+        return std::min(num_items, static_cast<int>(pos + BITMAP_NEXT_1(word)));
+    }
+
+    /// first slot at or after pos that holds data or a child, num_items if there is none
+    static int next_occupied(const Node* node, int pos)
+    {
+        return next_bit(NONE_BITMAP(node), true, node->num_items, pos);
+    }
+
+    /// first slot at or after pos that holds a child, num_items if there is none
+    static int next_child(const Node* node, int pos)
+    {
+        return next_bit(CHILD_BITMAP(node), false, node->num_items, pos);
+    }
+
+    /// number of slots of node that hold data
+    static int count_data(const Node* node)
+    {
+        int count = 0;
+        for (int pos = 0; pos < node->num_items; pos += BITMAP_WIDTH) {
+            count += BITMAP_COUNT(~BITMAP_WORD(NONE_BITMAP(node), pos) & ~BITMAP_WORD(CHILD_BITMAP(node), pos));
+        }
+        return count;
+    }
+
+    /// deleter handed to ebr->scheduleForDeletion() for a node unlinked from a live tree
+    static void free_node(void* ptr)
+    {
+        std::vector<AllocBlock> blocks;
+        collect_blocks(static_cast<Node*>(ptr), blocks);
+        Alloc::deallocate_bulk(blocks.data(), blocks.size());
+    }
+    /// deleter handed to ebr->scheduleForDeletion() for a heap allocated std::vector<Node*>
+    /// holding a whole unlinked subtree, which is released in one go
+    static void free_nodes(void* ptr)
+    {
+        std::vector<Node*>* nodes = static_cast<std::vector<Node*>*>(ptr);
+        std::vector<AllocBlock> blocks;
+        blocks.reserve(nodes->size() * 2);
+        for (Node* node : *nodes) {
+            collect_blocks(node, blocks);
+        }
+        Alloc::deallocate_bulk(blocks.data(), blocks.size());
+        delete nodes;
+    }
+
+    /// build an empty tree
+    Node* build_tree_none()
+    {
+        Node* node = new_nodes(1);
+        node->is_two = 0;
+        node->build_size = 0;
+        node->size = 0;
+        node->fixed = 0;
+        node->num_inserts = node->num_insert_to_data = 0;
+        node->model.a = node->model.b = 0;
+        new_slots(node, 1);
+        prepare_model(node, NULL, 0);
+
+        return node;
+    }
+    /// build a tree with two keys
+    Node* build_tree_two(T key1, P value1, T key2, P value2)
     {
         if (key1 > key2) {
             std::swap(key1, key2);
             std::swap(value1, value2);
         }
         RT_ASSERT(key1 < key2);
-        static_assert(BITMAP_WIDTH == 8);
-
-        Node* node = NULL;
-        if (pending_two.empty()) {
-            node = new_nodes(1);
-            node->is_two = 1;
-            node->build_size = 2;
-            node->size = 2;
-            node->fixed = 0;
-            node->num_inserts = node->num_insert_to_data = 0;
-
-            node->num_items = 8;
-            node->items = new_items(node->num_items);
-            node->none_bitmap = new_bitmap(1);
-            node->child_bitmap = new_bitmap(1);
-            node->none_bitmap[0] = 0xff;
-            node->child_bitmap[0] = 0;
-        } else {
-            node = pending_two.top(); pending_two.pop();
+        static_assert(BITMAP_WIDTH >= 8, "a two-key node keeps its bitmaps in one word");
+
+        local_counters().two_node_creations.add(1);
+        std::vector<Node*>& pool = two_pools.local();
+        if (pool.empty()) {
+            for (int i = 0; i < TWO_POOL_BATCH; i ++) {
+                Node* node = new_nodes(1);
+                node->is_two = 1;
+                node->build_size = 2;
+                node->size = 2;
+                node->fixed = 0;
+                node->num_inserts = node->num_insert_to_data = 0;
+                new_slots(node, 8);
+                pool.push_back(node);
+            }
         }
+        Node* node = pool.back(); pool.pop_back();
 
         const long double mid1_key = key1;
         const long double mid2_key = key2;
@@ -563,18 +1467,20 @@ private:
         node->model.b = mid1_target - node->model.a * mid1_key;
         RT_ASSERT(isfinite(node->model.a));
         RT_ASSERT(isfinite(node->model.b));
+        const T keys[2] = {key1, key2};
+        prepare_model(node, keys, 2);
 
         { // insert key1&value1
             int pos = PREDICT_POS(node, key1);
-            RT_ASSERT(BITMAP_GET(node->none_bitmap, pos) == 1);
-            BITMAP_CLEAR(node->none_bitmap, pos);
+            RT_ASSERT(BITMAP_GET(NONE_BITMAP(node), pos) == 1);
+            BITMAP_CLEAR(NONE_BITMAP(node), pos);
             node->items[pos].comp.data.key = key1;
             node->items[pos].comp.data.value = value1;
         }
         { // insert key2&value2
             int pos = PREDICT_POS(node, key2);
-            RT_ASSERT(BITMAP_GET(node->none_bitmap, pos) == 1);
-            BITMAP_CLEAR(node->none_bitmap, pos);
+            RT_ASSERT(BITMAP_GET(NONE_BITMAP(node), pos) == 1);
+            BITMAP_CLEAR(NONE_BITMAP(node), pos);
             node->items[pos].comp.data.key = key2;
             node->items[pos].comp.data.value = value2;
         }
@@ -582,7 +1488,7 @@ private:
         return node;
     }
     /// bulk build, _keys must be sorted in asc order.
-    Node* build_tree_bulk(T* _keys, P* _values, int _size)
+    Node* build_tree_bulk(const T* _keys, const P* _values, int _size)
     {
         if (USE_FMCD) {
             return build_tree_bulk_fmcd(_keys, _values, _size);
@@ -590,18 +1496,25 @@ private:
             return build_tree_bulk_fast(_keys, _values, _size);
         }
     }
+    /// build the replacement of a rebuilt subtree, which may have shrunk below two keys.
+    /// _keys must be sorted in asc order.
+    Node* build_tree_rebuild(const T* _keys, const P* _values, int _size)
+    {
+        if (_size >= 2) {
+            return build_tree_bulk(_keys, _values, _size);
+        }
+        Node* node = build_tree_none();
+        if (_size == 1) {
+            insert_private(node, _keys[0], _values[0]);
+        }
+        return node;
+    }
     /// bulk build, _keys must be sorted in asc order.
     /// split keys into three parts at each node.
-    Node* build_tree_bulk_fast(T* _keys, P* _values, int _size)
+    Node* build_tree_bulk_fast(const T* _keys, const P* _values, int _size)
     {
         RT_ASSERT(_size > 1);
 
-        typedef struct {
-            int begin;
-            int end;
-            int level; // top level = 1
-            Node* node;
-        } Segment;
         std::stack<Segment> s;
 
         Node* ret = new_nodes(1);
@@ -620,8 +1533,8 @@ private:
                 memcpy(node, _, sizeof(Node));
                 delete_nodes(_, 1);
             } else {
-                T* keys = _keys + begin;
-                P* values = _values + begin;
+                const T* keys = _keys + begin;
+                const P* values = _values + begin;
                 const int size = end - begin;
                 const int BUILD_GAP_CNT = compute_gap_count(size);
 
@@ -660,12 +1573,8 @@ private:
                     node->fixed = 1;
                 }
 
-                node->items = new_items(node->num_items);
-                const int bitmap_size = BITMAP_SIZE(node->num_items);
-                node->none_bitmap = new_bitmap(bitmap_size);
-                node->child_bitmap = new_bitmap(bitmap_size);
-                memset(node->none_bitmap, 0xff, sizeof(bitmap_t) * bitmap_size);
-                memset(node->child_bitmap, 0, sizeof(bitmap_t) * bitmap_size);
+                new_slots(node, node->num_items);
+                prepare_model(node, keys, size);
 
                 for (int item_i = PREDICT_POS(node, keys[0]), offset = 0; offset < size; ) {
                     int next = offset + 1, next_i = -1;
@@ -678,13 +1587,13 @@ private:
                         }
                     }
                     if (next == offset + 1) {
-                        BITMAP_CLEAR(node->none_bitmap, item_i);
+                        BITMAP_CLEAR(NONE_BITMAP(node), item_i);
                         node->items[item_i].comp.data.key = keys[offset];
                         node->items[item_i].comp.data.value = values[offset];
                     } else {
                         // ASSERT(next - offset <= (size+2) / 3);
-                        BITMAP_CLEAR(node->none_bitmap, item_i);
-                        BITMAP_SET(node->child_bitmap, item_i);
+                        BITMAP_CLEAR(NONE_BITMAP(node), item_i);
+                        BITMAP_SET(CHILD_BITMAP(node), item_i);
                         node->items[item_i].comp.child = new_nodes(1);
                         s.push((Segment){begin + offset, begin + next, level + 1, node->items[item_i].comp.child});
                     }
@@ -701,28 +1610,37 @@ private:
         return ret;
     }
     /// bulk build, _keys must be sorted in asc order.
-    /// FMCD method.
-    Node* build_tree_bulk_fmcd(T* _keys, P* _values, int _size)
+    /// FMCD method. The keys of segments of at least PARALLEL_BUILD_SIZE keys are
+    /// placed by several TBB tasks, each of which goes on to build the children of its part.
+    /// A task is the first to write the items of its part and all nodes below it, so
+    /// their pages come from the NUMA node the task runs on.
+    Node* build_tree_bulk_fmcd(const T* _keys, const P* _values, int _size)
     {
         RT_ASSERT(_size > 1);
 
-        typedef struct {
-            int begin;
-            int end;
-            int level; // top level = 1
-            Node* node;
-        } Segment;
         std::stack<Segment> s;
-
         Node* ret = new_nodes(1);
         s.push((Segment){0, _size, 1, ret});
 
+        if (_size < PARALLEL_BUILD_SIZE) {
+            build_segments_fmcd(_keys, _values, s, NULL);
+        } else {
+            tbb::task_group tasks;
+            build_segments_fmcd(_keys, _values, s, &tasks);
+            tasks.wait();
+        }
+
+        return ret;
+    }
+    /// build the segments in s and everything below them, see build_tree_bulk_fmcd().
+    /// with tasks == NULL all of it is done on the calling thread.
+    void build_segments_fmcd(const T* _keys, const P* _values, std::stack<Segment>& s, tbb::task_group* tasks)
+    {
         while (!s.empty()) {
-            const int begin = s.top().begin;
-            const int end = s.top().end;
-            const int level = s.top().level;
-            Node* node = s.top().node;
-            s.pop();
+            const Segment seg = s.top(); s.pop();
+            const int begin = seg.begin;
+            const int end = seg.end;
+            Node* node = seg.node;
 
             RT_ASSERT(end - begin >= 2);
             if (end - begin == 2) {
@@ -730,8 +1648,7 @@ private:
                 memcpy(node, _, sizeof(Node));
                 delete_nodes(_, 1);
             } else {
-                T* keys = _keys + begin;
-                P* values = _values + begin;
+                const T* keys = _keys + begin;
                 const int size = end - begin;
                 const int BUILD_GAP_CNT = compute_gap_count(size);
 
@@ -768,7 +1685,7 @@ private:
                              (static_cast<double>(L - 2)) + 1e-6;
                     }
                     if (D * 3 <= size) {
-                        stats.fmcd_success_times ++;
+                        local_counters().fmcd_success_times.add(1);
 
                         node->model.a = 1.0 / Ut;
                         node->model.b = (L - node->model.a * (static_cast<long double>(keys[size - 1 - D]) +
@@ -777,7 +1694,7 @@ private:
                         RT_ASSERT(isfinite(node->model.b));
                         node->num_items = L;
                     } else {
-                        stats.fmcd_broken_times ++;
+                        local_counters().fmcd_broken_times.add(1);
 
                         int mid1_pos = (size - 1) / 3;
                         int mid2_pos = (size - 1) * 2 / 3;
@@ -810,95 +1727,151 @@ private:
                     node->fixed = 1;
                 }
 
-                node->items = new_items(node->num_items);
-                const int bitmap_size = BITMAP_SIZE(node->num_items);
-                node->none_bitmap = new_bitmap(bitmap_size);
-                node->child_bitmap = new_bitmap(bitmap_size);
-                memset(node->none_bitmap, 0xff, sizeof(bitmap_t) * bitmap_size);
-                memset(node->child_bitmap, 0, sizeof(bitmap_t) * bitmap_size);
+                new_slots(node, node->num_items);
+                prepare_model(node, keys, size);
 
-                for (int item_i = PREDICT_POS(node, keys[0]), offset = 0; offset < size; ) {
-                    int next = offset + 1, next_i = -1;
-                    while (next < size) {
-                        next_i = PREDICT_POS(node, keys[next]);
-                        if (next_i == item_i) {
-                            next ++;
-                        } else {
-                            break;
-                        }
-                    }
-                    if (next == offset + 1) {
-                        BITMAP_CLEAR(node->none_bitmap, item_i);
-                        node->items[item_i].comp.data.key = keys[offset];
-                        node->items[item_i].comp.data.value = values[offset];
-                    } else {
-                        // ASSERT(next - offset <= (size+2) / 3);
-                        BITMAP_CLEAR(node->none_bitmap, item_i);
-                        BITMAP_SET(node->child_bitmap, item_i);
-                        node->items[item_i].comp.child = new_nodes(1);
-                        s.push((Segment){begin + offset, begin + next, level + 1, node->items[item_i].comp.child});
+                if (tasks == NULL || size < PARALLEL_BUILD_SIZE) {
+                    place_segment(_keys, _values, seg, 0, size, s);
+                    continue;
+                }
+                // cut the keys where a bitmap word begins, parts must not share one
+                const int num_parts = size / PARALLEL_BUILD_SIZE + 1;
+                for (int part = 1, from = 0; part <= num_parts; part ++) {
+                    int to = size;
+                    if (part < num_parts) {
+                        const int pos = PREDICT_POS(node, keys[static_cast<long long>(size) * part / num_parts]);
+                        const int word_begin = pos / BITMAP_WIDTH * BITMAP_WIDTH;
+                        to = std::partition_point(keys + from, keys + size, [&](const T& key) {
+                            return PREDICT_POS(node, key) < word_begin;
+                        }) - keys;
                     }
-                    if (next >= size) {
-                        break;
-                    } else {
-                        item_i = next_i;
-                        offset = next;
+                    if (from < to) {
+                        tasks->run([=] {
+                            std::stack<Segment> children;
+                            place_segment(_keys, _values, seg, from, to, children);
+                            build_segments_fmcd(_keys, _values, children, tasks);
+                        });
                     }
+                    from = to;
                 }
             }
         }
+    }
+    /// put keys [from, to) of seg, counted from seg.begin, into the slots of seg.node,
+    /// which is ready to take them. keys that share a slot become a child segment pushed
+    /// to s. from and to must not split such a group.
+    void place_segment(const T* _keys, const P* _values, const Segment& seg, int from, int to, std::stack<Segment>& s)
+    {
+        Node* node = seg.node;
+        const T* keys = _keys + seg.begin;
+        const P* values = _values + seg.begin;
+
+        for (int item_i = PREDICT_POS(node, keys[from]), offset = from; offset < to; ) {
+            int next = offset + 1, next_i = -1;
+            while (next < to) {
+                next_i = PREDICT_POS(node, keys[next]);
+                if (next_i == item_i) {
+                    next ++;
+                } else {
+                    break;
+                }
+            }
+            if (next == offset + 1) {
+                BITMAP_CLEAR(NONE_BITMAP(node), item_i);
+                node->items[item_i].comp.data.key = keys[offset];
+                node->items[item_i].comp.data.value = values[offset];
+            } else {
+                // ASSERT(next - offset <= (size+2) / 3);
+                BITMAP_CLEAR(NONE_BITMAP(node), item_i);
+                BITMAP_SET(CHILD_BITMAP(node), item_i);
+                node->items[item_i].comp.child = new_nodes(1);
+                s.push((Segment){seg.begin + offset, seg.begin + next, seg.level + 1, node->items[item_i].comp.child});
+            }
+            if (next >= to) {
+                break;
+            } else {
+                item_i = next_i;
+                offset = next;
+            }
+        }
+    }
 
-        return ret;
+    /// put a two-key node that is no longer in any tree back into the pool of this thread,
+    /// snapshot nodes stay in their mapping
+    void recycle_two(Node* node)
+    {
+        if (node->in_snapshot) {
+            return;
+        }
+        RT_ASSERT(node->build_size == 2);
+        RT_ASSERT(node->num_items == 8);
+        node->size = 2;
+        node->num_inserts = node->num_insert_to_data = 0;
+        clear_bitmaps(node);
+
+        std::vector<Node*>& pool = two_pools.local();
+        pool.push_back(node);
+        if (static_cast<int>(pool.size()) > TWO_POOL_HIGH_WATER) {
+            std::vector<AllocBlock> blocks;
+            while (static_cast<int>(pool.size()) > TWO_POOL_HIGH_WATER / 2) {
+                collect_blocks(pool.back(), blocks);
+                pool.pop_back();
+            }
+            Alloc::deallocate_bulk(blocks.data(), blocks.size());
+        }
     }
 
     void destory_pending()
     {
-        while (!pending_two.empty()) {
-            Node* node = pending_two.top(); pending_two.pop();
-
-            delete_items(node->items, node->num_items);
-            const int bitmap_size = BITMAP_SIZE(node->num_items);
-            delete_bitmap(node->none_bitmap, bitmap_size);
-            delete_bitmap(node->child_bitmap, bitmap_size);
-            delete_nodes(node, 1);
+        std::vector<AllocBlock> blocks;
+        for (std::vector<Node*>& pool : two_pools) {
+            for (Node* node : pool) {
+                collect_blocks(node, blocks);
+            }
+            pool.clear();
         }
+        Alloc::deallocate_bulk(blocks.data(), blocks.size());
     }
 
     void destroy_tree(Node* root)
     {
+        std::vector<AllocBlock> blocks;
         std::stack<Node*> s;
         s.push(root);
         while (!s.empty()) {
             Node* node = s.top(); s.pop();
 
-            for (int i = 0; i < node->num_items; i ++) {
-                if (BITMAP_GET(node->child_bitmap, i) == 1) {
-                    s.push(node->items[i].comp.child);
-                }
+            for (int i = next_child(node, 0); i < node->num_items; i = next_child(node, i + 1)) {
+                s.push(node->items[i].comp.child);
             }
 
             if (node->is_two) {
-                RT_ASSERT(node->build_size == 2);
-                RT_ASSERT(node->num_items == 8);
-                node->size = 2;
-                node->num_inserts = node->num_insert_to_data = 0;
-                node->none_bitmap[0] = 0xff;
-                node->child_bitmap[0] = 0;
-                pending_two.push(node);
+                recycle_two(node);
             } else {
-                delete_items(node->items, node->num_items);
-                const int bitmap_size = BITMAP_SIZE(node->num_items);
-                delete_bitmap(node->none_bitmap, bitmap_size);
-                delete_bitmap(node->child_bitmap, bitmap_size);
-                delete_nodes(node, 1);
+                collect_blocks(node, blocks);
             }
         }
+        Alloc::deallocate_bulk(blocks.data(), blocks.size());
     }
 
+    /// write the keys of a subtree, which no one else may modify, to keys and values in
+    /// order. child subtrees of at least PARALLEL_BUILD_SIZE keys are scanned by TBB tasks,
+    /// node->size tells where each of them starts in the output.
     void scan_and_destory_tree(Node* _root, T* keys, P* values, bool destory = true)
+    {
+        if (_root->size < PARALLEL_BUILD_SIZE) {
+            scan_and_destory_subtree(_root, keys, values, destory, NULL);
+            return;
+        }
+        tbb::task_group tasks;
+        scan_and_destory_subtree(_root, keys, values, destory, &tasks);
+        tasks.wait();
+    }
+    void scan_and_destory_subtree(Node* _root, T* keys, P* values, bool destory, tbb::task_group* tasks)
     {
         typedef std::pair<int, Node*> Segment; // <begin, Node*>
         std::stack<Segment> s;
+        std::vector<AllocBlock> blocks;
 
         s.push(Segment(0, _root));
         while (!s.empty()) {
@@ -907,41 +1880,994 @@ private:
             const int SHOULD_END_POS = begin + node->size;
             s.pop();
 
-            for (int i = 0; i < node->num_items; i ++) {
-                if (BITMAP_GET(node->none_bitmap, i) == 0) {
-                    if (BITMAP_GET(node->child_bitmap, i) == 0) {
-                        keys[begin] = node->items[i].comp.data.key;
-                        values[begin] = node->items[i].comp.data.value;
-                        begin ++;
+            for (int i = next_occupied(node, 0); i < node->num_items; i = next_occupied(node, i + 1)) {
+                if (BITMAP_GET(CHILD_BITMAP(node), i) == 0) {
+                    keys[begin] = node->items[i].comp.data.key;
+                    values[begin] = node->items[i].comp.data.value;
+                    begin ++;
+                } else {
+                    Node* child = node->items[i].comp.child;
+                    if (tasks != NULL && child->size >= PARALLEL_BUILD_SIZE) {
+                        tasks->run([=] {
+                            scan_and_destory_subtree(child, keys + begin, values + begin, destory, tasks);
+                        });
                     } else {
-                        s.push(Segment(begin, node->items[i].comp.child));
-                        begin += node->items[i].comp.child->size;
+                        s.push(Segment(begin, child));
                     }
+                    begin += child->size;
                 }
             }
             RT_ASSERT(SHOULD_END_POS == begin);
 
             if (destory) {
                 if (node->is_two) {
-                    RT_ASSERT(node->build_size == 2);
-                    RT_ASSERT(node->num_items == 8);
-                    node->size = 2;
-                    node->num_inserts = node->num_insert_to_data = 0;
-                    node->none_bitmap[0] = 0xff;
-                    node->child_bitmap[0] = 0;
-                    pending_two.push(node);
+                    recycle_two(node);
                 } else {
-                    delete_items(node->items, node->num_items);
-                    const int bitmap_size = BITMAP_SIZE(node->num_items);
-                    delete_bitmap(node->none_bitmap, bitmap_size);
-                    delete_bitmap(node->child_bitmap, bitmap_size);
-                    delete_nodes(node, 1);
+                    collect_blocks(node, blocks);
                 }
             }
         }
+        Alloc::deallocate_bulk(blocks.data(), blocks.size());
     }
 
-    Node* insert_tree(Node* _node, const T& key, const P& value)
+    /// Writers follow the same optimistic descent as readers and write-lock
+    /// only the node whose slot they change. The size and insert counters of
+    /// the whole path are bumped while that lock is held, so a subtree whose
+    /// nodes are all locked always has exact sizes. An existing key is
+    /// overwritten in place or left alone depending on mode, and a missing key
+    /// is not inserted with UPDATE_ONLY. Returns whether key was present.
+    bool insert_tree(const T& key, const P& value, WriteMode mode)
+    {
+        constexpr int MAX_DEPTH = 128;
+        Node* path[MAX_DEPTH];
+        int path_size = 0;
+        bool found = false;
+
+        int restarts = -1;
+        for (bool done = false; !done; ) {
+            restarts ++;
+            if (restarts > 0) {
+                yield(restarts); // back off, the writer in the way may have been preempted
+            }
+            bool needRestart = false;
+            path_size = 0;
+            Node* node = root;
+            uint64_t version = node->lock.readLockOrRestart(needRestart);
+            if (needRestart) continue;
+
+            while (true) {
+                RT_ASSERT(path_size < MAX_DEPTH);
+                path[path_size ++] = node;
+
+                int pos = PREDICT_POS(node, key);
+                if (BITMAP_GET(CHILD_BITMAP(node), pos) == 1) {
+                    Node* child = node->items[pos].comp.child;
+                    node->lock.checkOrRestart(version, needRestart);
+                    if (needRestart) break;
+                    version = child->lock.readLockOrRestart(needRestart);
+                    if (needRestart) break;
+                    node = child;
+                    continue;
+                }
+
+                found = BITMAP_GET(NONE_BITMAP(node), pos) == 0 && node->items[pos].comp.data.key == key;
+                if (found ? mode == INSERT_ONLY : mode == UPDATE_ONLY) {
+                    node->lock.checkOrRestart(version, needRestart);
+                    if (needRestart) break;
+                    done = true;
+                    break;
+                }
+
+                node->lock.upgradeToWriteLockOrRestart(version, needRestart);
+                if (needRestart) break;
+                if (!record_in_logs(path, path_size, (LogEntry){key, value, false})) {
+                    node->lock.writeUnlock();
+                    needRestart = true;
+                    break;
+                }
+
+                if (found) {
+                    node->items[pos].comp.data.value = value;
+                    node->lock.writeUnlock();
+                    done = true;
+                    break;
+                }
+
+                int insert_to_data = 0;
+                if (BITMAP_GET(NONE_BITMAP(node), pos) == 1) {
+                    node->items[pos].comp.data.key = key;
+                    node->items[pos].comp.data.value = value;
+                    BITMAP_CLEAR(NONE_BITMAP(node), pos);
+                } else {
+                    node->items[pos].comp.child = build_tree_two(key, value, node->items[pos].comp.data.key, node->items[pos].comp.data.value);
+                    BITMAP_SET(CHILD_BITMAP(node), pos);
+                    insert_to_data = 1;
+                }
+                for (int i = 0; i < path_size; i ++) {
+                    path[i]->size.fetch_add(1, std::memory_order_relaxed);
+                    path[i]->num_inserts.fetch_add(1, std::memory_order_relaxed);
+                    path[i]->num_insert_to_data.fetch_add(insert_to_data, std::memory_order_relaxed);
+                }
+                node->lock.writeUnlock();
+                done = true;
+                break;
+            }
+        }
+        if (restarts > 0) {
+            local_counters().olc_restarts.add(restarts);
+        }
+        if (found || mode == UPDATE_ONLY) {
+            return found;
+        }
+
+        rebuild_after_insert(path, path_size, key);
+        return false;
+    }
+
+    /// the subtree of node grew too much for its model, mostly into conflicts
+    static bool grew_unbalanced(const Node* node)
+    {
+        const int num_inserts = node->num_inserts;
+        const int num_insert_to_data = node->num_insert_to_data;
+        return node->fixed == 0 && node->size >= node->build_size * 4 && node->size >= 64 && num_insert_to_data * 10 >= num_inserts;
+    }
+    /// the subtree of node shrank far below the size it was built for
+    static bool shrank_sparse(const Node* node)
+    {
+        return node->build_size >= 64 && node->size * 8 < node->build_size;
+    }
+
+    /// rebuild the topmost node of path, which key was just inserted below, that grew
+    /// unbalanced. a large subtree is only queued for a shadow rebuild, unless path is
+    /// INLINE_REBUILD_DEPTH long: then the queued rebuilds fall behind a growing chain of
+    /// conflicts, and the insert shadow rebuilds the subtree itself.
+    void rebuild_after_insert(Node* const* path, int path_size, const T& key)
+    {
+        for (int i = 0; i < path_size; i ++) {
+            Node* node = path[i];
+            if (node->rebuild_log.load() != NULL) {
+                // node itself is being shadow rebuilt, but the subtrees below it are still
+                // rebuilt when they need it: a chain of conflicts must not grow until the copy
+                // is published. a rebuild keeps the keys as they are, so the snapshot and the
+                // log stay valid. erase_tree() follows the same rule.
+                continue;
+            }
+            if (grew_unbalanced(node)) {
+                if (node->size < SHADOW_REBUILD_SIZE) {
+                    rebuild_tree_locked(i > 0 ? path[i-1] : NULL, node, key, i);
+                } else if (path_size >= INLINE_REBUILD_DEPTH) {
+                    rebuild_tree_shadow(i > 0 ? path[i-1] : NULL, node, key, i);
+                } else {
+                    queue_shadow_rebuild(node, key);
+                }
+                break;
+            }
+        }
+    }
+
+    /// insert_batch() below node, which was read at version and is reached through
+    /// path[0, depth). vs[begin, end) are the keys that route through node. parts that
+    /// hit a conflict are added to scratch.retry; returns the number of keys inserted.
+    int insert_batch_tree(Node** path, int depth, Node* node, uint64_t version, const V* vs, int begin, int end,
+                          BatchScratch& scratch)
+    {
+        constexpr int MAX_DEPTH = 128;
+        RT_ASSERT(depth < MAX_DEPTH);
+        path[depth] = node;
+
+        // a large share of a subtree small enough for a locked rebuild is merged into it
+        const int n = end - begin;
+        const int size = node->size;
+        if (n >= MERGE_BATCH_SIZE && size + n >= node->build_size * 4 && size + n < SHADOW_REBUILD_SIZE && node->rebuild_log.load() == NULL) {
+            const int inserted = merge_rebuild_locked(path, depth, vs + begin, n);
+            if (inserted < 0) {
+                scratch.retry.push_back({begin, end});
+                return 0;
+            }
+            return inserted;
+        }
+
+        // split the keys by predicted slot. a part that lands on a data or None slot is
+        // turned into what the slot will hold before the node is locked: the key itself,
+        // or a new subtree of the keys and the one already there
+        std::vector<BatchPart>& parts = scratch.parts;
+        const size_t first_part = parts.size(); // parts of the nodes above come before
+        scratch.entries.clear();
+        int inserted = 0, insert_to_data = 0;
+        for (int i = begin, last_pos = -1; i < end; ) {
+            const int pos = PREDICT_POS(node, vs[i].first);
+            RT_ASSERT(pos > last_pos); // models are monotone, so a slot gets one part at most
+            last_pos = pos;
+            int j = i + 1;
+            while (j < end && PREDICT_POS(node, vs[j].first) == pos) {
+                j ++;
+            }
+            BatchPart part = {i, j, pos, NULL, BITMAP_GET(CHILD_BITMAP(node), pos) == 1};
+            i = j;
+            if (part.to_child) {
+                part.child = node->items[pos].comp.child;
+                parts.push_back(part);
+                continue;
+            }
+
+            std::vector<T>& keys = scratch.keys;
+            std::vector<P>& values = scratch.values;
+            keys.clear();
+            values.clear();
+            const bool is_data = BITMAP_GET(NONE_BITMAP(node), pos) == 0;
+            const T data_key = node->items[pos].comp.data.key;
+            const P data_value = node->items[pos].comp.data.value;
+            bool data_placed = !is_data;
+            for (int k = part.begin; k < part.end; k ++) {
+                if (!data_placed && data_key <= vs[k].first) {
+                    keys.push_back(data_key);
+                    values.push_back(data_value);
+                    data_placed = true;
+                    if (data_key == vs[k].first) {
+                        continue; // already present, not inserted
+                    }
+                }
+                keys.push_back(vs[k].first);
+                values.push_back(vs[k].second);
+                scratch.entries.push_back((LogEntry){vs[k].first, vs[k].second, false});
+            }
+            if (!data_placed) {
+                keys.push_back(data_key);
+                values.push_back(data_value);
+            }
+            const int added = static_cast<int>(keys.size()) - is_data;
+            if (added == 0) {
+                continue;
+            }
+            inserted += added;
+            insert_to_data += is_data ? added : added - 1;
+            if (keys.size() == 2) {
+                part.child = build_tree_two(keys[0], values[0], keys[1], values[1]);
+            } else if (keys.size() > 2) {
+                part.child = build_tree_rebuild(keys.data(), values.data(), keys.size());
+            }
+            parts.push_back(part);
+        }
+        const size_t end_part = parts.size();
+
+        // write the slots of node, or give the whole range to retry if it changed
+        bool needRestart = false;
+        if (inserted > 0) {
+            node->lock.upgradeToWriteLockOrRestart(version, needRestart);
+            if (!needRestart && !record_in_logs(path, depth + 1, scratch.entries.data(), scratch.entries.size())) {
+                node->lock.writeUnlock();
+                needRestart = true;
+            }
+        } else {
+            node->lock.checkOrRestart(version, needRestart);
+        }
+        if (needRestart) {
+            for (size_t i = first_part; i < end_part; i ++) {
+                if (!parts[i].to_child && parts[i].child != NULL) {
+                    destroy_tree(parts[i].child);
+                }
+            }
+            parts.resize(first_part);
+            scratch.retry.push_back({begin, end});
+            return 0;
+        }
+        if (inserted > 0) {
+            for (size_t i = first_part; i < end_part; i ++) {
+                const BatchPart& part = parts[i];
+                if (part.to_child) {
+                    continue;
+                }
+                BITMAP_CLEAR(NONE_BITMAP(node), part.pos);
+                if (part.child != NULL) {
+                    node->items[part.pos].comp.child = part.child;
+                    BITMAP_SET(CHILD_BITMAP(node), part.pos);
+                } else {
+                    node->items[part.pos].comp.data.key = vs[part.begin].first;
+                    node->items[part.pos].comp.data.value = vs[part.begin].second;
+                }
+            }
+            for (int i = 0; i <= depth; i ++) {
+                path[i]->size.fetch_add(inserted, std::memory_order_relaxed);
+                path[i]->num_inserts.fetch_add(inserted, std::memory_order_relaxed);
+                path[i]->num_insert_to_data.fetch_add(insert_to_data, std::memory_order_relaxed);
+            }
+            node->lock.writeUnlock();
+            rebuild_after_insert(path, depth + 1, scratch.entries[0].key);
+        }
+
+        // the children, whose parts are appended after end_part and dropped again
+        for (size_t i = first_part; i < end_part; i ++) {
+            const BatchPart part = parts[i];
+            if (!part.to_child) {
+                continue;
+            }
+            const uint64_t child_version = part.child->lock.readLockOrRestart(needRestart);
+            if (needRestart) {
+                scratch.retry.push_back({part.begin, part.end});
+                needRestart = false;
+                continue;
+            }
+            inserted += insert_batch_tree(path, depth + 1, part.child, child_version, vs, part.begin, part.end, scratch);
+        }
+        parts.resize(first_part);
+        return inserted;
+    }
+
+    /// merge the n keys of vs that are not present yet into the subtree rooted at
+    /// path[depth], rebuilt with the whole subtree locked. returns the number of keys
+    /// inserted, or -1 if the subtree could not be locked as it is and the caller has
+    /// to retry from the root.
+    int merge_rebuild_locked(Node* const* path, int depth, const V* vs, int n)
+    {
+        Node* parent = depth > 0 ? path[depth-1] : NULL;
+        Node* node = path[depth];
+        const T& key = vs[0].first;
+
+        bool needRestart = false;
+        Node* top = parent != NULL ? parent : node;
+        top->lock.writeLockOrRestart(needRestart);
+        if (needRestart) return -1;
+
+        int pos = -1;
+        if (parent != NULL) {
+            pos = PREDICT_POS(parent, key);
+            if (BITMAP_GET(CHILD_BITMAP(parent), pos) == 0 || parent->items[pos].comp.child != node) {
+                parent->lock.writeUnlock();
+                return -1;
+            }
+        } else if (root != node) {
+            node->lock.writeUnlock();
+            return -1;
+        }
+        if (node->rebuild_log.load() != NULL) {
+            top->lock.writeUnlock();
+            return -1;
+        }
+
+        std::vector<Node*> old_nodes;
+        lock_subtree(node, parent == NULL, old_nodes);
+
+        const int ESIZE = node->size;
+        T* old_keys = new T[ESIZE];
+        P* old_values = new P[ESIZE];
+        scan_and_destory_tree(node, old_keys, old_values, false);
+
+        T* keys = new T[ESIZE + n];
+        P* values = new P[ESIZE + n];
+        std::vector<LogEntry> entries;
+        int size = 0;
+        for (int i = 0, j = 0; i < ESIZE || j < n; ) {
+            if (j == n || (i < ESIZE && old_keys[i] <= vs[j].first)) {
+                j += j < n && old_keys[i] == vs[j].first;
+                keys[size] = old_keys[i];
+                values[size ++] = old_values[i ++];
+            } else {
+                entries.push_back((LogEntry){vs[j].first, vs[j].second, false});
+                keys[size] = vs[j].first;
+                values[size ++] = vs[j ++].second;
+            }
+        }
+        delete[] old_keys;
+        delete[] old_values;
+        const int inserted = size - ESIZE;
+
+        if (!record_in_logs(path, depth, entries.data(), entries.size())) {
+            delete[] keys;
+            delete[] values;
+            for (Node* old_node : old_nodes) {
+                old_node->lock.writeUnlock();
+            }
+            if (parent != NULL) {
+                parent->lock.writeUnlock();
+            }
+            return -1;
+        }
+
+        Node* new_node = build_tree_rebuild(keys, values, size);
+        delete[] keys;
+        delete[] values;
+        interleave_top_levels(new_node, depth);
+        count_rebuild(depth, size, subtree_bytes(new_node));
+
+        for (int i = 0; i < depth; i ++) {
+            path[i]->size.fetch_add(inserted, std::memory_order_relaxed);
+            path[i]->num_inserts.fetch_add(inserted, std::memory_order_relaxed);
+        }
+        if (parent != NULL) {
+            parent->items[pos].comp.child = new_node;
+        } else {
+            root = new_node;
+        }
+        // old nodes may still be visited by optimistic readers, free them through ebr
+        for (Node* old_node : old_nodes) {
+            old_node->lock.writeUnlockObsolete();
+        }
+        ebr->scheduleForDeletion(std::make_pair(static_cast<void*>(new std::vector<Node*>(std::move(old_nodes))), &LIPP::free_nodes));
+        if (parent != NULL) {
+            parent->lock.writeUnlock();
+        }
+        return inserted;
+    }
+
+    /// Erase mirrors insert_tree(): the slot is cleared under the write lock of
+    /// its node and the path sizes drop while that lock is held. Unlinking empty
+    /// children needs the parent lock as well, so it happens afterwards, bottom-up.
+    bool erase_tree(const T& key)
+    {
+        constexpr int MAX_DEPTH = 128;
+        Node* path[MAX_DEPTH];
+        int path_size = 0;
+        bool erased = false;
+
+        int restarts = -1;
+        for (bool done = false; !done; ) {
+            restarts ++;
+            if (restarts > 0) {
+                yield(restarts); // back off, the writer in the way may have been preempted
+            }
+            bool needRestart = false;
+            path_size = 0;
+            Node* node = root;
+            uint64_t version = node->lock.readLockOrRestart(needRestart);
+            if (needRestart) continue;
+
+            while (true) {
+                RT_ASSERT(path_size < MAX_DEPTH);
+                path[path_size ++] = node;
+
+                int pos = PREDICT_POS(node, key);
+                if (BITMAP_GET(CHILD_BITMAP(node), pos) == 1) {
+                    Node* child = node->items[pos].comp.child;
+                    node->lock.checkOrRestart(version, needRestart);
+                    if (needRestart) break;
+                    version = child->lock.readLockOrRestart(needRestart);
+                    if (needRestart) break;
+                    node = child;
+                    continue;
+                }
+
+                if (BITMAP_GET(NONE_BITMAP(node), pos) == 1 || node->items[pos].comp.data.key != key) {
+                    node->lock.checkOrRestart(version, needRestart);
+                    if (needRestart) break;
+                    done = true;
+                    break;
+                }
+
+                node->lock.upgradeToWriteLockOrRestart(version, needRestart);
+                if (needRestart) break;
+                if (!record_in_logs(path, path_size, (LogEntry){key, P(), true})) {
+                    node->lock.writeUnlock();
+                    needRestart = true;
+                    break;
+                }
+
+                BITMAP_SET(NONE_BITMAP(node), pos);
+                for (int i = 0; i < path_size; i ++) {
+                    path[i]->size.fetch_sub(1, std::memory_order_relaxed);
+                }
+                node->lock.writeUnlock();
+                erased = done = true;
+                break;
+            }
+        }
+        if (restarts > 0) {
+            local_counters().olc_restarts.add(restarts);
+        }
+        if (!erased) {
+            return false;
+        }
+
+        for (int i = path_size - 1; i > 0 && collapse_tree(path[i-1], path[i], key); i --) {}
+
+        for (int i = 0; i < path_size; i ++) {
+            Node* node = path[i];
+            if (node->lock.isObsolete()) {
+                break; // collapsed, nothing below it is in the tree any more
+            }
+            if (node->rebuild_log.load() != NULL) {
+                continue; // the same rule as in rebuild_after_insert()
+            }
+            if (shrank_sparse(node)) {
+                if (node->size >= SHADOW_REBUILD_SIZE) {
+                    queue_shadow_rebuild(node, key);
+                } else {
+                    rebuild_tree_locked(i > 0 ? path[i-1] : NULL, node, key, i);
+                }
+                break;
+            }
+        }
+        return true;
+    }
+
+    /// unlink node from parent if it holds neither keys nor children. returns false if
+    /// node is not empty or one of the two locks is not available right away.
+    bool collapse_tree(Node* parent, Node* node, const T& key)
+    {
+        if (node->size != 0 || node->rebuild_log.load() != NULL) {
+            return false;
+        }
+
+        bool needRestart = false;
+        parent->lock.writeLockOrRestart(needRestart);
+        if (needRestart) return false;
+        int pos = PREDICT_POS(parent, key);
+        if (BITMAP_GET(CHILD_BITMAP(parent), pos) == 0 || parent->items[pos].comp.child != node) {
+            parent->lock.writeUnlock();
+            return false;
+        }
+        node->lock.writeLockOrRestart(needRestart);
+        if (needRestart) {
+            parent->lock.writeUnlock();
+            return false;
+        }
+        // size alone is not enough, an insert below node may not have counted itself yet
+        if (next_occupied(node, 0) < node->num_items) {
+            node->lock.writeUnlock();
+            parent->lock.writeUnlock();
+            return false;
+        }
+
+        BITMAP_CLEAR(CHILD_BITMAP(parent), pos);
+        BITMAP_SET(NONE_BITMAP(parent), pos);
+        parent->lock.writeUnlock();
+        node->lock.writeUnlockObsolete();
+        ebr->scheduleForDeletion(std::make_pair(static_cast<void*>(node), &LIPP::free_node));
+        return true;
+    }
+
+    /// append a write to the log of every subtree on path that is being shadow rebuilt.
+    /// must be called with the write lock of the node being modified held.
+    /// returns false if one of the logs is already closed, the caller has to restart.
+    bool record_in_logs(Node* const* path, int path_size, const LogEntry& entry)
+    {
+        return record_in_logs(path, path_size, &entry, 1);
+    }
+    /// same for the writes of a batch to one node
+    bool record_in_logs(Node* const* path, int path_size, const LogEntry* entries, int num_entries)
+    {
+        RebuildLog* logs[path_size];
+        int num_logs = 0;
+        bool closed = false;
+        for (int i = 0; i < path_size && !closed; i ++) {
+            RebuildLog* log = path[i]->rebuild_log.load();
+            if (log != NULL) {
+                log->lock.lock();
+                logs[num_logs ++] = log;
+                closed = log->closed;
+            }
+        }
+        for (int i = 0; i < num_logs; i ++) {
+            if (!closed) {
+                logs[i]->entries.insert(logs[i]->entries.end(), entries, entries + num_entries);
+            }
+            logs[i]->lock.unlock();
+        }
+        return !closed;
+    }
+
+    /// write-lock every node of the subtree rooted at node (top-down), except node itself
+    /// when skip_root is set. Spinning is deadlock free because writers only ever hold one
+    /// node lock and rebuilders acquire their locks top-down.
+    void lock_subtree(Node* _node, bool skip_root, std::vector<Node*>& locked)
+    {
+        std::stack<Node*> s;
+        s.push(_node);
+        while (!s.empty()) {
+            Node* node = s.top(); s.pop();
+            if (!(skip_root && node == _node)) {
+                for (int count = 0; ; count ++) {
+                    bool needRestart = false;
+                    node->lock.writeLockOrRestart(needRestart);
+                    if (!needRestart) break;
+                    yield(count);
+                }
+            }
+            locked.push_back(node);
+            for (int i = next_child(node, 0); i < node->num_items; i = next_child(node, i + 1)) {
+                s.push(node->items[i].comp.child);
+            }
+        }
+    }
+
+    /// rebuild the subtree rooted at node with the whole subtree locked; parent is NULL
+    /// when node is the root. gives up if another thread is already restructuring this
+    /// part of the tree, the next insert that finds the subtree unbalanced will try again.
+    void rebuild_tree_locked(Node* parent, Node* node, const T& key, int depth)
+    {
+        bool needRestart = false;
+        Node* top = parent != NULL ? parent : node;
+        top->lock.writeLockOrRestart(needRestart);
+        if (needRestart) return;
+
+        int pos = -1;
+        if (parent != NULL) {
+            pos = PREDICT_POS(parent, key);
+            if (BITMAP_GET(CHILD_BITMAP(parent), pos) == 0 || parent->items[pos].comp.child != node) {
+                parent->lock.writeUnlock();
+                return;
+            }
+        } else if (root != node) {
+            node->lock.writeUnlock();
+            return;
+        }
+
+        std::vector<Node*> old_nodes;
+        lock_subtree(node, parent == NULL, old_nodes);
+
+        const int ESIZE = node->size;
+        T* keys = new T[ESIZE];
+        P* values = new P[ESIZE];
+
+        #if COLLECT_TIME
+        auto start_time_scan = std::chrono::high_resolution_clock::now();
+        #endif
+        scan_and_destory_tree(node, keys, values, false);
+        #if COLLECT_TIME
+        auto end_time_scan = std::chrono::high_resolution_clock::now();
+        auto duration_scan = end_time_scan - start_time_scan;
+        stats.time_scan_and_destory_tree += std::chrono::duration_cast<std::chrono::nanoseconds>(duration_scan).count() * 1e-9;
+        #endif
+
+        #if COLLECT_TIME
+        auto start_time_build = std::chrono::high_resolution_clock::now();
+        #endif
+        Node* new_node = build_tree_rebuild(keys, values, ESIZE);
+        #if COLLECT_TIME
+        auto end_time_build = std::chrono::high_resolution_clock::now();
+        auto duration_build = end_time_build - start_time_build;
+        stats.time_build_tree_bulk += std::chrono::duration_cast<std::chrono::nanoseconds>(duration_build).count() * 1e-9;
+        #endif
+
+        delete[] keys;
+        delete[] values;
+        interleave_top_levels(new_node, depth);
+        count_rebuild(depth, ESIZE, subtree_bytes(new_node));
+
+        if (parent != NULL) {
+            parent->items[pos].comp.child = new_node;
+        } else {
+            root = new_node;
+        }
+        // old nodes may still be visited by optimistic readers, free them through ebr
+        for (Node* old_node : old_nodes) {
+            old_node->lock.writeUnlockObsolete();
+        }
+        ebr->scheduleForDeletion(std::make_pair(static_cast<void*>(new std::vector<Node*>(std::move(old_nodes))), &LIPP::free_nodes));
+        if (parent != NULL) {
+            parent->lock.writeUnlock();
+        }
+    }
+
+    /// hand the shadow rebuild of node, which lies on the path of key, to a task of
+    /// rebuild_arena unless one is queued for it already, so the writer that found it due
+    /// returns right away. the task does not keep node: it may be replaced before the
+    /// task runs, so the task looks the path of key up again.
+    void queue_shadow_rebuild(Node* node, const T& key)
+    {
+        if (node->rebuild_pending.load() || node->rebuild_pending.exchange(true)) {
+            return;
+        }
+        queued_rebuilds.fetch_add(1);
+        rebuild_arena.enqueue([this, key] {
+            run_shadow_rebuild(key);
+            queued_rebuilds.fetch_sub(1);
+        });
+    }
+
+    /// the task of queue_shadow_rebuild(): shadow rebuild the topmost node on the current
+    /// path of key that still needs it and is large enough for that
+    void run_shadow_rebuild(const T& key)
+    {
+        EpochGuard guard(ebr); // epoch memory reclaimation
+
+        constexpr int MAX_DEPTH = 128;
+        Node* path[MAX_DEPTH];
+        int path_size = 0;
+        for (bool done = false; !done; ) {
+            bool needRestart = false;
+            path_size = 0;
+            Node* node = root;
+            uint64_t version = node->lock.readLockOrRestart(needRestart);
+            if (needRestart) continue;
+
+            while (true) {
+                RT_ASSERT(path_size < MAX_DEPTH);
+                path[path_size ++] = node;
+
+                int pos = PREDICT_POS(node, key);
+                if (BITMAP_GET(CHILD_BITMAP(node), pos) == 0) {
+                    node->lock.checkOrRestart(version, needRestart);
+                    done = !needRestart;
+                    break;
+                }
+                Node* child = node->items[pos].comp.child;
+                node->lock.checkOrRestart(version, needRestart);
+                if (needRestart) break;
+                version = child->lock.readLockOrRestart(needRestart);
+                if (needRestart) break;
+                node = child;
+            }
+        }
+
+        // from here on writers may queue these nodes again
+        for (int i = 0; i < path_size; i ++) {
+            path[i]->rebuild_pending.store(false);
+        }
+        for (int i = 0; i < path_size; i ++) {
+            Node* node = path[i];
+            if (node->rebuild_log.load() != NULL) {
+                continue;
+            }
+            if (node->size >= SHADOW_REBUILD_SIZE && (grew_unbalanced(node) || shrank_sparse(node))) {
+                rebuild_tree_shadow(i > 0 ? path[i-1] : NULL, node, key, i);
+                break;
+            }
+        }
+    }
+
+    /// wait until no shadow rebuild is queued or running any more
+    void wait_rebuilds() const
+    {
+        for (int count = 0; queued_rebuilds.load() != 0; count ++) {
+            yield(count);
+        }
+    }
+
+    /// rebuild the subtree rooted at node without blocking other threads; parent is NULL
+    /// when node is the root. the subtree is copied and rebuilt aside while writers keep
+    /// inserting into it and record their keys in node->rebuild_log. the log is replayed
+    /// into the copy, closed, and the copy is published with a single pointer swap.
+    void rebuild_tree_shadow(Node* parent, Node* node, const T& key, int depth)
+    {
+        RebuildLog* log = new RebuildLog();
+        RebuildLog* expected = NULL;
+        if (!node->rebuild_log.compare_exchange_strong(expected, log)) {
+            delete log;
+            return;
+        }
+
+        Node* new_node = NULL;
+        {
+            std::vector<T> keys;
+            std::vector<P> values;
+            keys.reserve(std::max(0, static_cast<int>(node->size)));
+            values.reserve(std::max(0, static_cast<int>(node->size)));
+            #if COLLECT_TIME
+            auto start_time_scan = std::chrono::high_resolution_clock::now();
+            #endif
+            snapshot_tree(node, keys, values);
+            #if COLLECT_TIME
+            auto end_time_scan = std::chrono::high_resolution_clock::now();
+            auto duration_scan = end_time_scan - start_time_scan;
+            stats.time_scan_and_destory_tree += std::chrono::duration_cast<std::chrono::nanoseconds>(duration_scan).count() * 1e-9;
+            #endif
+
+            #if COLLECT_TIME
+            auto start_time_build = std::chrono::high_resolution_clock::now();
+            #endif
+            new_node = build_tree_rebuild(keys.data(), values.data(), keys.size());
+            #if COLLECT_TIME
+            auto end_time_build = std::chrono::high_resolution_clock::now();
+            auto duration_build = end_time_build - start_time_build;
+            stats.time_build_tree_bulk += std::chrono::duration_cast<std::chrono::nanoseconds>(duration_build).count() * 1e-9;
+            #endif
+        }
+
+        // catch up with the writes that landed during the build. once the backlog is
+        // small the copy is placed and measured, while writers still append to the log;
+        // the log is closed when the backlog is small again, so writers spin only while
+        // that last batch is replayed and the swap is made. the bytes added by keys
+        // replayed after the measurement are not counted.
+        constexpr size_t CLOSE_LOG_SIZE = 64;
+        std::vector<LogEntry> pending;
+        size_t new_bytes = 0;
+        for (bool measured = false, closed = false; !closed; ) {
+            log->lock.lock();
+            pending.swap(log->entries);
+            if (measured && pending.size() < CLOSE_LOG_SIZE) {
+                log->closed = closed = true;
+            }
+            log->lock.unlock();
+            for (const LogEntry& e : pending) {
+                if (e.erase) {
+                    erase_private(new_node, e.key);
+                } else {
+                    new_node = insert_private(new_node, e.key, e.value);
+                }
+            }
+            if (!measured && pending.size() < CLOSE_LOG_SIZE) {
+                interleave_top_levels(new_node, depth);
+                new_bytes = subtree_bytes(new_node);
+                measured = true;
+            }
+            pending.clear();
+        }
+        const int new_size = new_node->size;
+
+        // the node owning the slot is locked for the swap: the parent, or the old root itself
+        Node* top = parent != NULL ? parent : node;
+        bool locked = false;
+        for (int count = 0; !top->lock.isObsolete(); count ++) {
+            bool needRestart = false;
+            top->lock.writeLockOrRestart(needRestart);
+            if (!needRestart) {
+                locked = true;
+                break;
+            }
+            yield(count);
+        }
+
+        bool swapped = false;
+        if (locked) {
+            if (parent != NULL) {
+                int pos = PREDICT_POS(parent, key);
+                if (BITMAP_GET(CHILD_BITMAP(parent), pos) == 1 && parent->items[pos].comp.child == node) {
+                    parent->items[pos].comp.child = new_node;
+                    swapped = true;
+                }
+                parent->lock.writeUnlock();
+            } else if (root == node) {
+                root = new_node;
+                swapped = true;
+            } else {
+                node->lock.writeUnlock();
+            }
+        }
+
+        if (swapped) {
+            count_rebuild(depth, new_size, new_bytes);
+            retire_tree(node, parent == NULL);
+        } else {
+            // node was replaced by a rebuild of an enclosing subtree, which also owns its retirement
+            destroy_tree(new_node);
+        }
+    }
+
+    /// a slot of a live node as seen by snapshot_tree()
+    struct Slot
+    {
+        Node* child; // NULL for a data slot
+        T key;
+        P value;
+    };
+    /// append the occupied slots of node to slots, all read under one version number;
+    /// an obsolete node is read as it is, since its content never changes again.
+    void read_slots(Node* node, std::vector<Slot>& slots) const
+    {
+        const size_t old_size = slots.size();
+        for (int count = 0; ; count ++) {
+            uint64_t version = node->lock.get_version_number();
+            if (node->lock.isLocked(version)) {
+                yield(count);
+                continue;
+            }
+            slots.resize(old_size);
+            for (int i = next_occupied(node, 0); i < node->num_items; i = next_occupied(node, i + 1)) {
+                if (BITMAP_GET(CHILD_BITMAP(node), i) == 1) {
+                    slots.push_back((Slot){node->items[i].comp.child, T(), P()});
+                } else {
+                    slots.push_back((Slot){NULL, node->items[i].comp.data.key, node->items[i].comp.data.value});
+                }
+            }
+            if (node->lock.get_version_number() == version) {
+                break;
+            }
+        }
+    }
+
+    /// copy the keys of a live subtree in order without blocking writers, each node
+    /// is read with read_slots(). a subtree of at least PARALLEL_BUILD_SIZE keys is
+    /// read down to its children below that size, which are then copied by parallel
+    /// TBB tasks and concatenated.
+    void snapshot_tree(Node* _node, std::vector<T>& keys, std::vector<P>& values)
+    {
+        if (_node->size >= PARALLEL_BUILD_SIZE) {
+            snapshot_tree_parallel(_node, keys, values);
+            return;
+        }
+
+        std::vector<Slot> s;
+        s.push_back((Slot){_node, T(), P()});
+        while (!s.empty()) {
+            Slot slot = s.back(); s.pop_back();
+            if (slot.child == NULL) {
+                keys.push_back(slot.key);
+                values.push_back(slot.value);
+                continue;
+            }
+            const size_t top = s.size();
+            read_slots(slot.child, s);
+            std::reverse(s.begin() + top, s.end());
+        }
+    }
+    void snapshot_tree_parallel(Node* _node, std::vector<T>& keys, std::vector<P>& values)
+    {
+        // consecutive data slots are gathered in one part, a child makes a part of its own
+        struct Part {
+            Node* child;
+            std::vector<T> keys;
+            std::vector<P> values;
+        };
+        std::vector<Part> parts;
+        std::vector<Slot> s;
+        s.push_back((Slot){_node, T(), P()});
+        while (!s.empty()) {
+            Slot slot = s.back(); s.pop_back();
+            if (slot.child == NULL) {
+                if (parts.empty() || parts.back().child != NULL) {
+                    parts.push_back(Part{NULL});
+                }
+                parts.back().keys.push_back(slot.key);
+                parts.back().values.push_back(slot.value);
+            } else if (slot.child->size < PARALLEL_BUILD_SIZE) {
+                parts.push_back(Part{slot.child});
+            } else {
+                const size_t top = s.size();
+                read_slots(slot.child, s);
+                std::reverse(s.begin() + top, s.end());
+            }
+        }
+
+        tbb::parallel_for(size_t(0), parts.size(), [&](size_t i) {
+            if (parts[i].child != NULL) {
+                parts[i].keys.reserve(std::max(0, static_cast<int>(parts[i].child->size)));
+                parts[i].values.reserve(std::max(0, static_cast<int>(parts[i].child->size)));
+                snapshot_tree(parts[i].child, parts[i].keys, parts[i].values);
+            }
+        });
+
+        std::vector<size_t> offsets(parts.size() + 1, keys.size());
+        for (size_t i = 0; i < parts.size(); i ++) {
+            offsets[i + 1] = offsets[i] + parts[i].keys.size();
+        }
+        keys.resize(offsets.back());
+        values.resize(offsets.back());
+        tbb::parallel_for(size_t(0), parts.size(), [&](size_t i) {
+            std::copy(parts[i].keys.begin(), parts[i].keys.end(), keys.begin() + offsets[i]);
+            std::copy(parts[i].values.begin(), parts[i].values.end(), values.begin() + offsets[i]);
+        });
+    }
+
+    /// mark every node of a subtree that was just unlinked obsolete and hand it to ebr.
+    /// nodes are locked top-down, so no one can still be modifying them.
+    void retire_tree(Node* _node, bool root_locked)
+    {
+        std::vector<Node*>* retired = new std::vector<Node*>();
+        std::stack<Node*> s;
+        s.push(_node);
+        while (!s.empty()) {
+            Node* node = s.top(); s.pop();
+            if (!(root_locked && node == _node)) {
+                for (int count = 0; ; count ++) {
+                    bool needRestart = false;
+                    node->lock.writeLockOrRestart(needRestart);
+                    if (!needRestart) break;
+                    yield(count);
+                }
+            }
+            for (int i = next_child(node, 0); i < node->num_items; i = next_child(node, i + 1)) {
+                s.push(node->items[i].comp.child);
+            }
+            node->lock.writeUnlockObsolete();
+            retired->push_back(node);
+        }
+        ebr->scheduleForDeletion(std::make_pair(static_cast<void*>(retired), &LIPP::free_nodes));
+    }
+
+    /// rebuild a subtree that is not yet visible to other threads, returns its new root
+    Node* rebuild_private(Node* node)
+    {
+        const int size = node->size;
+        std::vector<T> keys(size);
+        std::vector<P> values(size);
+        scan_and_destory_tree(node, keys.data(), values.data());
+        return build_tree_rebuild(keys.data(), values.data(), size);
+    }
+
+    /// single threaded insert into a subtree that is not yet visible to other threads.
+    /// an existing key gets its value overwritten. a part of the subtree that grew out
+    /// of its model is rebuilt as in insert(), returns the (new) root of the subtree.
+    Node* insert_private(Node* _node, const T& key, const P& value)
     {
         constexpr int MAX_DEPTH = 128;
         Node* path[MAX_DEPTH];
@@ -952,16 +2878,18 @@ private:
             RT_ASSERT(path_size < MAX_DEPTH);
             path[path_size ++] = node;
 
-            node->size ++;
-            node->num_inserts ++;
             int pos = PREDICT_POS(node, key);
-            if (BITMAP_GET(node->none_bitmap, pos) == 1) {
-                BITMAP_CLEAR(node->none_bitmap, pos);
+            if (BITMAP_GET(NONE_BITMAP(node), pos) == 1) {
+                BITMAP_CLEAR(NONE_BITMAP(node), pos);
                 node->items[pos].comp.data.key = key;
                 node->items[pos].comp.data.value = value;
                 break;
-            } else if (BITMAP_GET(node->child_bitmap, pos) == 0) {
-                BITMAP_SET(node->child_bitmap, pos);
+            } else if (BITMAP_GET(CHILD_BITMAP(node), pos) == 0) {
+                if (node->items[pos].comp.data.key == key) {
+                    node->items[pos].comp.data.value = value;
+                    return _node;
+                }
+                BITMAP_SET(CHILD_BITMAP(node), pos);
                 node->items[pos].comp.child = build_tree_two(key, value, node->items[pos].comp.data.key, node->items[pos].comp.data.value);
                 insert_to_data = 1;
                 break;
@@ -970,54 +2898,52 @@ private:
             }
         }
         for (int i = 0; i < path_size; i ++) {
+            path[i]->size ++;
+            path[i]->num_inserts ++;
             path[i]->num_insert_to_data += insert_to_data;
         }
 
         for (int i = 0; i < path_size; i ++) {
             Node* node = path[i];
-            const int num_inserts = node->num_inserts;
-            const int num_insert_to_data = node->num_insert_to_data;
-            const bool need_rebuild = node->fixed == 0 && node->size >= node->build_size * 4 && node->size >= 64 && num_insert_to_data * 10 >= num_inserts;
-
-            if (need_rebuild) {
-                const int ESIZE = node->size;
-                T* keys = new T[ESIZE];
-                P* values = new P[ESIZE];
-
-                #if COLLECT_TIME
-                auto start_time_scan = std::chrono::high_resolution_clock::now();
-                #endif
-                scan_and_destory_tree(node, keys, values);
-                #if COLLECT_TIME
-                auto end_time_scan = std::chrono::high_resolution_clock::now();
-                auto duration_scan = end_time_scan - start_time_scan;
-                stats.time_scan_and_destory_tree += std::chrono::duration_cast<std::chrono::nanoseconds>(duration_scan).count() * 1e-9;
-                #endif
-
-                #if COLLECT_TIME
-                auto start_time_build = std::chrono::high_resolution_clock::now();
-                #endif
-                Node* new_node = build_tree_bulk(keys, values, ESIZE);
-                #if COLLECT_TIME
-                auto end_time_build = std::chrono::high_resolution_clock::now();
-                auto duration_build = end_time_build - start_time_build;
-                stats.time_build_tree_bulk += std::chrono::duration_cast<std::chrono::nanoseconds>(duration_build).count() * 1e-9;
-                #endif
-
-                delete[] keys;
-                delete[] values;
-
-                path[i] = new_node;
-                if (i > 0) {
-                    int pos = PREDICT_POS(path[i-1], key);
-                    path[i-1]->items[pos].comp.child = new_node;
+            if (grew_unbalanced(node)) {
+                Node* new_node = rebuild_private(node);
+                if (i == 0) {
+                    return new_node;
                 }
-
+                path[i-1]->items[PREDICT_POS(path[i-1], key)].comp.child = new_node;
                 break;
             }
         }
+        return _node;
+    }
+
+    /// single threaded erase from a subtree that is not yet visible to other threads
+    void erase_private(Node* _node, const T& key)
+    {
+        constexpr int MAX_DEPTH = 128;
+        Node* path[MAX_DEPTH];
+        int path_size = 0;
 
-        return path[0];
+        for (Node* node = _node; ; ) {
+            RT_ASSERT(path_size < MAX_DEPTH);
+            path[path_size ++] = node;
+
+            int pos = PREDICT_POS(node, key);
+            if (BITMAP_GET(NONE_BITMAP(node), pos) == 1) {
+                return;
+            } else if (BITMAP_GET(CHILD_BITMAP(node), pos) == 0) {
+                if (node->items[pos].comp.data.key != key) {
+                    return;
+                }
+                BITMAP_SET(NONE_BITMAP(node), pos);
+                break;
+            } else {
+                node = node->items[pos].comp.child;
+            }
+        }
+        for (int i = 0; i < path_size; i ++) {
+            path[i]->size --;
+        }
     }
 };
 
@@ -5,18 +5,29 @@
 #include <cmath>
 #include <cstdlib>
 #include <algorithm>
+#include <type_traits>
 
 // Linear regression model
+// a and b are what the builders fit, predict() and predict_double() evaluate them
+// in long double. predict_fast() evaluates the same line in double only, as
+// a * (key - anchor) + c: for integer keys the difference is taken in integers, so
+// large keys keep all their bits, and c is small because anchor sits where the
+// line crosses 0. It is valid after prepare_fast() and only approximates the long
+// double prediction, callers decide per model whether it is good enough (fast).
 template <class T>
 class LinearModel
 {
 public:
     double a = 0; // slope
+    T anchor = 0; // first key predicted at or above 0 (integer keys only)
+    double c = 0; // prediction of anchor
+    bool fast = false; // predictions use predict_fast()
     long double b = 0; // intercept
 
     LinearModel() = default;
     LinearModel(double a, long double b) : a(a), b(b) {}
-    explicit LinearModel(const LinearModel &other) : a(other.a), b(other.b) {}
+    explicit LinearModel(const LinearModel &other)
+        : a(other.a), anchor(other.anchor), c(other.c), fast(other.fast), b(other.b) {}
 
     inline int predict(T key) const
     {
@@ -27,6 +38,37 @@ public:
     {
         return a * static_cast<long double>(key) + b;
     }
+
+    void prepare_fast()
+    {
+        if (!std::is_integral<T>::value || a == 0) {
+            anchor = std::is_integral<T>::value ? std::numeric_limits<T>::lowest() : T(0);
+            c = b;
+            return;
+        }
+        const long double x0 = std::ceil(-b / a);
+        if (x0 <= static_cast<long double>(std::numeric_limits<T>::lowest())) {
+            anchor = std::numeric_limits<T>::lowest();
+        } else if (x0 >= static_cast<long double>(std::numeric_limits<T>::max())) {
+            anchor = std::numeric_limits<T>::max();
+        } else {
+            anchor = static_cast<T>(x0);
+        }
+        c = a * static_cast<long double>(anchor) + b;
+    }
+
+    inline double predict_fast(T key) const
+    {
+        if constexpr (std::is_integral<T>::value) {
+            typedef typename std::make_unsigned<T>::type U;
+            if (key < anchor) {
+                return -1;
+            }
+            return a * static_cast<double>(static_cast<U>(key) - static_cast<U>(anchor)) + c;
+        } else {
+            return a * static_cast<double>(key) + c;
+        }
+    }
 };
 
 #endif // __LIPP_BASE_H__
@@ -0,0 +1,390 @@
+#include <lipp.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// Randomized check of LIPP against std::map: inserts, batch inserts, updates and
+// erases from one and from several threads, writers and readers on the same keys,
+// erases racing the inserts that trigger rebuilds of their subtree, a save/open
+// round trip that keeps modifying the opened index, and verify() of the structure.
+// Everything runs once with the default shadow rebuild size and once with a small
+// one, so that shadow rebuilds replay the writes of other threads too. Prints
+// "regression passed" at the end; RT_ASSERT inside LIPP exits early without it.
+
+#define CHECK(expr) \
+{ \
+    if (!(expr)) { \
+        fprintf(stderr, "CHECK failed at %s:%d, `%s`\n", __FILE__, __LINE__, #expr); \
+        abort(); \
+    } \
+}
+
+typedef LIPP<uint64_t, uint64_t> Index;
+typedef map<uint64_t, uint64_t> Map;
+
+const int THREADS = 4;
+
+// half uniform, half in a few dense clusters whose keys conflict and force rebuilds.
+// keys of partition part of parts are congruent to part
+uint64_t random_key(mt19937_64& gen, uint64_t part, uint64_t parts)
+{
+    uint64_t key = gen() % 2 ? gen() >> 16 : (gen() % 8) * (1ULL << 40) + gen() % 200000;
+    return key - key % parts + part;
+}
+
+// a key of expected near key if there is one, so that updates and erases hit
+uint64_t existing_key(const Map& expected, uint64_t key)
+{
+    Map::const_iterator it = expected.lower_bound(key);
+    return it == expected.end() ? key : it->first;
+}
+
+// n random operations on the keys of one partition, expected holds exactly those
+void random_ops(Index& lipp, Map& expected, int n, uint64_t seed, uint64_t part, uint64_t parts)
+{
+    mt19937_64 gen(seed);
+    vector<pair<uint64_t, uint64_t>> batch;
+    for (int i = 0; i < n; i ++) {
+        uint64_t key = random_key(gen, part, parts);
+        const uint64_t value = gen();
+        switch (gen() % 10) {
+        case 0:
+        case 1:
+        case 2:
+            CHECK(lipp.insert(key, value) == expected.insert({key, value}).second);
+            break;
+        case 3: {
+            // a run of keys around key, sorted and within the partition
+            batch.clear();
+            const int size = 1 + gen() % 32;
+            const uint64_t step = parts * (1 + gen() % 4);
+            int inserted = 0;
+            for (int j = 0; j < size; j ++) {
+                batch.push_back({key + j * step, value + j});
+                inserted += expected.insert(batch.back()).second;
+            }
+            CHECK(lipp.insert_batch(batch.data(), batch.size()) == inserted);
+            break;
+        }
+        case 4:
+            key = existing_key(expected, key);
+            CHECK(lipp.update(key, value) == (expected.count(key) == 1));
+            if (expected.count(key) == 1) {
+                expected[key] = value;
+            }
+            break;
+        case 5:
+            CHECK(lipp.insert_or_assign(key, value) == (expected.count(key) == 0));
+            expected[key] = value;
+            break;
+        case 6:
+        case 7:
+        case 8:
+            key = gen() % 4 ? existing_key(expected, key) : key;
+            CHECK(lipp.erase(key) == (expected.erase(key) == 1));
+            break;
+        default:
+            key = existing_key(expected, key);
+            CHECK(lipp.exists(key) == (expected.count(key) == 1));
+            if (expected.count(key) == 1) {
+                CHECK(lipp.at(key, false) == expected[key]);
+            }
+            break;
+        }
+    }
+}
+
+// the operations of random_ops() from THREADS threads at once, each on a partition
+// of the keys of its own
+void concurrent_ops(Index& lipp, Map& expected, int n, uint64_t seed)
+{
+    vector<Map> parts(THREADS);
+    for (const auto& kv : expected) {
+        parts[kv.first % THREADS].insert(kv);
+    }
+    vector<thread> threads;
+    for (int t = 0; t < THREADS; t ++) {
+        threads.emplace_back([&, t] { random_ops(lipp, parts[t], n, seed + t, t, THREADS); });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    expected.clear();
+    for (const Map& part : parts) {
+        expected.insert(part.begin(), part.end());
+    }
+}
+
+// keys of the phases below, far from the keys random_key() draws in clusters
+const uint64_t POOL_BASE = 9ULL << 40;
+const int POOL_SIZE = 4096;
+const uint64_t RACE_BASE = 10ULL << 40;
+const int RACE_SIZE = 40000;
+
+// values of the contended phase carry their key, so a reader can tell that a value
+// it sees was written for that key
+uint64_t tagged(uint64_t key, uint64_t tag)
+{
+    return key << 16 | (tag & 0xffff);
+}
+
+// drop the keys in [lo, hi) from the index and from expected
+void clear_range(Index& lipp, Map& expected, uint64_t lo, uint64_t hi)
+{
+    for (Map::iterator it = expected.lower_bound(lo); it != expected.end() && it->first < hi; ) {
+        CHECK(lipp.erase(it->first));
+        it = expected.erase(it);
+    }
+}
+
+// two writers and two readers on one pool of keys. every eighth key is stable: it
+// is only ever updated, so readers must always find it, with a value tagged with
+// it. the other keys are inserted, assigned, batch inserted and erased by both
+// writers at once, which grows and shrinks their nodes into rebuilds. the pool
+// is read back into expected afterwards.
+void contended_ops(Index& lipp, Map& expected, int n, uint64_t seed)
+{
+    clear_range(lipp, expected, POOL_BASE, POOL_BASE + POOL_SIZE * 3);
+    for (int i = 0; i < POOL_SIZE; i += 8) {
+        const uint64_t key = POOL_BASE + i * 3;
+        CHECK(lipp.insert(key, tagged(key, 0)));
+    }
+
+    atomic<int> writing(2);
+    vector<thread> threads;
+    for (int t = 0; t < 2; t ++) {
+        threads.emplace_back([&, t] {
+            mt19937_64 gen(seed + t);
+            vector<pair<uint64_t, uint64_t>> batch;
+            for (int i = 0; i < n; i ++) {
+                const int slot = gen() % POOL_SIZE;
+                const uint64_t key = POOL_BASE + slot * 3;
+                const uint64_t value = tagged(key, gen());
+                if (slot % 8 == 0) {
+                    CHECK(lipp.update(key, value));
+                    continue;
+                }
+                switch (gen() % 5) {
+                case 0:
+                    lipp.insert(key, value);
+                    break;
+                case 1:
+                    lipp.insert_or_assign(key, value);
+                    break;
+                case 2: {
+                    batch.clear();
+                    for (int j = slot; j < POOL_SIZE && j < slot + 16; j ++) {
+                        if (j % 8 != 0) {
+                            batch.push_back({POOL_BASE + j * 3, tagged(POOL_BASE + j * 3, gen())});
+                        }
+                    }
+                    lipp.insert_batch(batch.data(), batch.size());
+                    break;
+                }
+                default:
+                    lipp.erase(key);
+                    break;
+                }
+            }
+            writing --;
+        });
+    }
+    for (int t = 0; t < 2; t ++) {
+        threads.emplace_back([&, t] {
+            mt19937_64 gen(seed + 2 + t);
+            vector<pair<uint64_t, uint64_t>> out(256);
+            vector<uint64_t> keys(64), values(64);
+            while (writing.load() > 0) {
+                const uint64_t key = POOL_BASE + gen() % (POOL_SIZE / 8) * 8 * 3;
+                CHECK(lipp.exists(key));
+                CHECK(lipp.at(key, false) >> 16 == key);
+
+                for (size_t i = 0; i < keys.size(); i ++) {
+                    keys[i] = POOL_BASE + gen() % (POOL_SIZE / 8) * 8 * 3;
+                }
+                lipp.multi_at(keys.data(), values.data(), keys.size());
+                for (size_t i = 0; i < keys.size(); i ++) {
+                    CHECK(values[i] >> 16 == keys[i]);
+                }
+
+                // ascending pairs of pool keys with their own values, no stable key missing
+                const uint64_t lo = POOL_BASE + gen() % POOL_SIZE * 3;
+                const int count = lipp.range_scan(lo, out.size(), out.data());
+                uint64_t next_stable = POOL_BASE + (lo - POOL_BASE + 23) / 24 * 24;
+                for (int i = 0; i < count && out[i].first < POOL_BASE + POOL_SIZE * 3; i ++) {
+                    CHECK(out[i].second >> 16 == out[i].first);
+                    CHECK(i == 0 || out[i - 1].first < out[i].first);
+                    CHECK(out[i].first <= next_stable);
+                    if (out[i].first == next_stable) {
+                        next_stable += 24;
+                    }
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    vector<pair<uint64_t, uint64_t>> out(POOL_SIZE);
+    const int count = lipp.range_scan(POOL_BASE, out.size(), out.data());
+    for (int i = 0; i < count && out[i].first < POOL_BASE + POOL_SIZE * 3; i ++) {
+        CHECK(out[i].second >> 16 == out[i].first);
+        expected[out[i].first] = out[i].second;
+    }
+    for (int i = 0; i < POOL_SIZE; i += 8) {
+        CHECK(expected.count(POOL_BASE + i * 3) == 1);
+    }
+}
+
+// one thread erases the odd keys of a cluster while another inserts even keys
+// between and past them, so the subtree is rebuilt, shadow rebuilt with a small
+// SHADOW_REBUILD_SIZE, while erases land in it
+void erase_during_rebuild(Index& lipp, Map& expected, uint64_t seed)
+{
+    clear_range(lipp, expected, RACE_BASE, RACE_BASE + RACE_SIZE * 4);
+    vector<pair<uint64_t, uint64_t>> odd;
+    for (int i = 0; i < RACE_SIZE; i ++) {
+        odd.push_back({RACE_BASE + i * 2 + 1, i});
+    }
+    CHECK(lipp.insert_batch(odd.data(), odd.size()) == RACE_SIZE);
+    const long long rebuilds = lipp.get_metrics().rebuild_times();
+
+    thread inserter([&] {
+        vector<uint64_t> keys;
+        for (int i = 0; i < RACE_SIZE * 2; i ++) {
+            keys.push_back(RACE_BASE + i * 2);
+        }
+        shuffle(keys.begin(), keys.end(), mt19937_64(seed));
+        for (uint64_t key : keys) {
+            CHECK(lipp.insert(key, key));
+        }
+    });
+    thread eraser([&] {
+        shuffle(odd.begin(), odd.end(), mt19937_64(seed + 1));
+        for (const auto& kv : odd) {
+            CHECK(lipp.erase(kv.first));
+        }
+    });
+    inserter.join();
+    eraser.join();
+
+    for (int i = 0; i < RACE_SIZE * 2; i ++) {
+        expected[RACE_BASE + i * 2] = RACE_BASE + i * 2;
+    }
+    CHECK(lipp.get_metrics().rebuild_times() > rebuilds);
+}
+
+// the index holds exactly the pairs of expected, by scan, by key and by batch
+void compare(const Index& lipp, const Map& expected)
+{
+    lipp.verify();
+
+    vector<pair<uint64_t, uint64_t>> out(1000);
+    Map::const_iterator it = expected.begin();
+    uint64_t lo = 0;
+    while (true) {
+        const int n = lipp.range_scan(lo, out.size(), out.data());
+        for (int i = 0; i < n; i ++, ++ it) {
+            CHECK(it != expected.end() && out[i].first == it->first && out[i].second == it->second);
+        }
+        if (n < static_cast<int>(out.size())) {
+            break;
+        }
+        lo = out[n - 1].first + 1;
+    }
+    CHECK(it == expected.end());
+
+    vector<uint64_t> keys, values(expected.size());
+    for (const auto& kv : expected) {
+        keys.push_back(kv.first);
+    }
+    lipp.multi_at(keys.data(), values.data(), keys.size());
+    it = expected.begin();
+    for (size_t i = 0; i < keys.size(); i ++, ++ it) {
+        CHECK(values[i] == it->second);
+    }
+}
+
+vector<uint64_t> sorted_keys(const Map& expected)
+{
+    vector<uint64_t> keys;
+    for (const auto& kv : expected) {
+        keys.push_back(kv.first);
+    }
+    return keys;
+}
+
+void run(int shadow_rebuild_size)
+{
+    Index lipp(0, true, shadow_rebuild_size);
+    Map expected;
+    mt19937_64 gen(shadow_rebuild_size);
+    while (expected.size() < 100000) {
+        const uint64_t key = random_key(gen, 0, 1);
+        expected.insert({key, key + 1});
+    }
+    vector<pair<uint64_t, uint64_t>> data(expected.begin(), expected.end());
+    lipp.bulk_load(data.data(), data.size());
+    compare(lipp, expected);
+
+    random_ops(lipp, expected, 100000, 1, 0, 1);
+    compare(lipp, expected);
+    concurrent_ops(lipp, expected, 50000, 2);
+    compare(lipp, expected);
+    contended_ops(lipp, expected, 50000, 10);
+    compare(lipp, expected);
+    erase_during_rebuild(lipp, expected, 20);
+    compare(lipp, expected);
+
+    // save, open and keep modifying the opened index, then once more from that
+    char path[] = "/tmp/lipp_regression_XXXXXX";
+    const int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    for (int round = 0; round < 2; round ++) {
+        CHECK(lipp.save(path));
+        Index opened(0, true, shadow_rebuild_size);
+        vector<uint64_t> keys = sorted_keys(expected);
+        CHECK(!opened.open(path, keys.data(), keys.size() - 1));
+        // same count, smallest and largest key, one key in between moved
+        size_t moved = keys.size() / 2;
+        while (keys[moved] + 1 == keys[moved + 1]) {
+            moved ++;
+        }
+        keys[moved] ++;
+        CHECK(!opened.open(path, keys.data(), keys.size()));
+        keys[moved] --;
+        CHECK(opened.open(path, keys.data(), keys.size()));
+        compare(opened, expected);
+
+        random_ops(opened, expected, 50000, 3 + round, 0, 1);
+        compare(opened, expected);
+        concurrent_ops(opened, expected, 25000, 5 + round * THREADS);
+        compare(opened, expected);
+
+        CHECK(opened.save(path));
+        keys = sorted_keys(expected);
+        CHECK(lipp.open(path, keys.data(), keys.size()));
+        compare(lipp, expected);
+    }
+    unlink(path);
+
+    printf("shadow_rebuild_size = %d: %zu keys\n", shadow_rebuild_size, expected.size());
+}
+
+int main()
+{
+    run(16384);
+    run(64);
+    printf("regression passed\n");
+    return 0;
+}